@@ -18,11 +18,41 @@
 #include <linux/serial_core.h>
 #include <linux/8250_pci.h>
 #include <linux/bitops.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/pm_qos.h>
+#include <linux/capability.h>
+#include <linux/rcupdate.h>
+#include <linux/kref.h>
+#include <linux/crc16.h>
+#include <linux/crc32.h>
+#include <linux/jump_label.h>
+#include <linux/vmalloc.h>
+#include <linux/console.h>
+#include <linux/irq_work.h>
+#include <linux/pps_kernel.h>
+#include <linux/completion.h>
 
 #include <asm/byteorder.h>
 #include <asm/io.h>
+#include <asm/unaligned.h>
 
 #include "8250.h"
+#include "addi_serial.h"
 
 /*
  * init function returns:
@@ -46,15 +76,471 @@ struct pci_serial_quirk
 
 #define PCI_NUM_BAR_RESOURCES 6
 
+/*
+ * Largest ADDI-DATA board has 8 UARTs; every board gets a block of
+ * this many tty lines when lines are assigned per slot.
+ */
+#define ADDI_SERIAL_MAX_PORTS 8
+#define ADDI_SERIAL_IRQ_PRIOS 4
+#define ADDI_SERIAL_MAX_BOARDS 16
+
+/*
+ * Per-port driver state.  Hung off uart_port->private_data and exposed
+ * in sysfs as /sys/bus/pci/devices/<dev>/portN.
+ */
+#define ADDI_SERIAL_URGENT_SIZE 1024
+#define ADDI_SERIAL_TIMED_QUEUE 64
+#define ADDI_SERIAL_TIMED_REPORTS 32
+#define ADDI_SERIAL_BCAST_QUEUE 16
+
+/* Group write data, shared by every member port queueing it */
+struct addi_bcast_buf
+{
+	struct kref ref;
+	u32 len;
+	unsigned char data[];
+};
+
+struct addi_timed_frame
+{
+	struct list_head node;
+	ktime_t when;
+	ktime_t launch;
+	u32 id;
+	u32 len;
+	u32 pos;
+	unsigned char data[];
+};
+
+/*
+ * Port life cycle.  With warm set, closing only quiesces the UART and
+ * keeps the IRQ linked and the line settings programmed, so the next
+ * open is a few register writes instead of a full 8250 startup.
+ * A port going cold is CLOSING from the queue flush in shutdown() until
+ * the 8250 shutdown is done.
+ */
+enum addi_port_state
+{
+	ADDI_PORT_COLD = 0,
+	ADDI_PORT_ACTIVE,
+	ADDI_PORT_WARM,
+	ADDI_PORT_CLOSING,
+};
+
+#define ADDI_SERIAL_HIST_BUCKETS 16
+
+/*
+ * Per-port TX ring behind the serial core's one-page xmit buffer.
+ * start_tx() moves whatever write() put into xmit over here, so a
+ * writer only blocks once the ring is full.  head and tail run freely
+ * and are masked on access.
+ *
+ * The ring is single-producer/single-consumer: producers serialise on
+ * addi_port.tx_prod_lock and only move head, the TX refill runs under
+ * port->lock and only moves tail.  An addi_raw write() therefore fills
+ * the ring without port->lock and takes it only to restart an idle
+ * transmitter.
+ */
+#define ADDI_SERIAL_RX_CPU_OFF (-1)
+#define ADDI_SERIAL_RX_CPU_AUTO (-2)
+
+#define ADDI_SERIAL_TX_RING_MIN PAGE_SIZE
+#define ADDI_SERIAL_TX_RING_MAX (8 << 20)
+
+struct addi_tx_ring
+{
+	unsigned char *buf;
+	u32 size;
+	u32 head;
+	u32 tail;
+};
+
+/*
+ * Per-board traffic capture.  Records (struct addi_cap_rec, then the
+ * data) are written back to back into an overwrite ring; head and tail
+ * run free and tail is the oldest record still complete.
+ */
+#define ADDI_CAPTURE_BURST 256
+
+struct addi_cap_rec
+{
+	u64 ts;
+	u16 len;
+	u8 port;
+	u8 flags;
+};
+
+struct addi_capture
+{
+	spinlock_t lock;
+	unsigned char *buf;
+	u32 size;
+	u64 head;
+	u64 tail;
+	u64 records;
+	u64 overwritten;
+};
+
+/* A running ADDI_SERIAL_IOC_MCR_SEQUENCE, see addi_serial_mcr_fire() */
+#define ADDI_SERIAL_MCR_BITS \
+	(TIOCM_DTR | TIOCM_RTS | TIOCM_OUT1 | TIOCM_OUT2 | TIOCM_LOOP)
+
+struct addi_mcr_seq
+{
+	unsigned int count;
+	unsigned int pos;
+	ktime_t start;
+	ktime_t next;
+	struct completion done;
+	struct addi_serial_mcr_step steps[ADDI_SERIAL_MCR_STEPS];
+	u64 actual[ADDI_SERIAL_MCR_STEPS];
+};
+
+/* Auto-responder table, see addi_serial_resp_rx() */
+struct addi_responder
+{
+	unsigned int count;
+	struct addi_serial_response e[];
+};
+
+struct addi_port
+{
+	struct kobject kobj;
+	struct list_head node;
+	struct serial_private *priv;
+	struct uart_8250_port *up;
+	unsigned int idx;
+	int line;
+
+	/*
+	 * The 8250 core's uart_ops with our overrides; orig_ops is put
+	 * back when the port is handed back to the core.
+	 */
+	struct uart_ops ops;
+	const struct uart_ops *orig_ops;
+
+	struct addi_tx_ring ring;
+	spinlock_t tx_prod_lock;
+	/*
+	 * Writer wakeup low watermark in percent of the ring that must be
+	 * free, 0 for the serial core's WAKEUP_CHARS behaviour.
+	 * tx_writer_blocked is set once xmit could not be fully spilled.
+	 */
+	unsigned int tx_wake_pct;
+	bool tx_writer_blocked;
+
+	/*
+	 * CPU whose NUMA node gets the flip buffer push:
+	 * ADDI_SERIAL_RX_CPU_OFF for the IRQ CPU, ADDI_SERIAL_RX_CPU_AUTO
+	 * for the CPU of the last addi_raw read(), or a fixed CPU.  rx_work
+	 * does the push there when that node is not the IRQ CPU's.
+	 */
+	int rx_cpu;
+	int reader_cpu;
+	struct work_struct rx_work;
+
+	/*
+	 * Port our received data is forwarded to, see addi_serial_bridge_send().
+	 * Written under addi_serial_ports_lock.
+	 */
+	struct addi_port __rcu *bridge;
+	bool bridge_monitor;
+
+	/* PM QoS while open, see addi_serial_qos_apply() */
+	struct mutex qos_lock;
+	int latency_us;
+	bool latency_irq_cpu;
+	bool qos_open;
+	int qos_cpu;
+	struct pm_qos_request qos;
+	struct dev_pm_qos_request cpu_qos;
+
+	/*
+	 * Board handler order, see addi_serial_board_service(): higher
+	 * irq_prio first, at most irq_budget received bytes (0 = FIFO
+	 * drain) per pass.  rx_budget_hit is set by addi_serial_rx_chars()
+	 * when it stopped at that budget in the last service.
+	 */
+	unsigned int irq_prio;
+	unsigned int irq_budget;
+	bool rx_budget_hit;
+
+	/* High-priority TX lane, drained before the TX ring */
+	struct circ_buf urgent;
+	unsigned char urgent_buf[ADDI_SERIAL_URGENT_SIZE];
+
+	/*
+	 * Group writes queued on this port, sent after the urgent lane.
+	 * bcast_hold keeps them back until all members are loaded.
+	 */
+	unsigned int group;
+	struct
+	{
+		struct addi_bcast_buf *buf;
+		u32 pos;
+	} bcast[ADDI_SERIAL_BCAST_QUEUE];
+	unsigned int bcast_head;
+	unsigned int bcast_tail;
+	bool bcast_hold;
+
+	/* Transmitter held for a synchronised start, see addi_serial_sync_start() */
+	bool sync_armed;
+
+	/*
+	 * Auto-responder: the table and the frame received so far.  All
+	 * of it is used and changed under port->lock.
+	 */
+	struct addi_responder *resp;
+	unsigned char resp_frame[ADDI_SERIAL_RESP_MATCH_LEN];
+	unsigned int resp_len;
+	ktime_t resp_last;
+
+	/*
+	 * PPS source on DCD or CTS: pps_delta is the MSR delta bit that
+	 * fires it, 0 when off.  Changed under port->lock.
+	 */
+	u8 pps_delta;
+	struct pps_device *pps;
+	ktime_t edge_last;
+	s64 edge_period;
+
+	/* Burst being captured, see addi_capture_flush() */
+	bool capture;
+	u8 cap_flags;
+	u16 cap_len;
+	u64 cap_ts;
+	unsigned char cap_buf[ADDI_CAPTURE_BURST];
+
+	/*
+	 * Timed frames: timed_queue is sorted by launch time and fed to
+	 * timed_active by timed_timer; the TX refill drains timed_active
+	 * ahead of the urgent lane.
+	 */
+	struct hrtimer timed_timer;
+	struct hrtimer mcr_timer;
+	struct addi_mcr_seq *mcr_seq;
+
+	/*
+	 * Autobaud, see addi_serial_autobaud_rx().  ab_idx indexes
+	 * addi_autobaud_rates; ab_skip drops the byte that was cut in
+	 * half by the last rate change or resync; ab_confirm is set once
+	 * the candidate rate passed its first window.
+	 */
+	bool ab_active;
+	bool ab_skip;
+	bool ab_confirm;
+	unsigned int ab_idx;
+	unsigned int ab_good;
+	unsigned int ab_need;
+	int ab_sync;
+	unsigned int ab_baud;
+	struct completion ab_done;
+	struct work_struct ab_work;
+	struct list_head timed_queue;
+	struct list_head timed_active;
+	unsigned int timed_count;
+	struct addi_serial_timed_report timed_report[ADDI_SERIAL_TIMED_REPORTS];
+	unsigned int report_head, report_tail;
+
+	/*
+	 * TX drain tracking.  drain_end is the predicted end of the last
+	 * stop bit of everything loaded so far; drain_timer checks TEMT
+	 * at that time and wakes drain_wq.
+	 */
+	u64 char_ns;
+	ktime_t drain_end;
+	struct hrtimer drain_timer;
+	wait_queue_head_t drain_wq;
+
+	enum addi_port_state state;
+	bool irq_linked;
+	bool warm;
+	bool warm_restore;
+	bool tx_hold;
+	unsigned char warm_ier;
+	struct ktermios termios;
+
+	struct dentry *debugfs;
+	struct
+	{
+		u64 drains;
+		u64 drain_overshoot_ns;
+		u64 drain_overshoot_max_ns;
+		/* log2(us) histograms of startup/shutdown, cold and warm */
+		u32 open_cold[ADDI_SERIAL_HIST_BUCKETS];
+		u32 open_warm[ADDI_SERIAL_HIST_BUCKETS];
+		u32 close_cold[ADDI_SERIAL_HIST_BUCKETS];
+		u32 close_warm[ADDI_SERIAL_HIST_BUCKETS];
+		/* speed-only set_termios, see addi_serial_set_speed() */
+		u64 speed_changes;
+		u64 speed_tx_busy;
+		u64 speed_wait_ns;
+		u64 speed_switch_ns;
+		u64 speed_switch_max_ns;
+		u64 tx_wakeups;
+		/* TX ring producers, see addi_serial_ring_write() */
+		u64 tx_writes_lockless;
+		u64 tx_writes_locked;
+		/* Also bumped by bridged peers, from their own IRQ */
+		atomic64_t tx_lock_contended;
+		u64 tx_spill_busy;
+		/* addi_raw line discipline */
+		u64 ldisc_rx_bytes;
+		u64 ldisc_rx_errors;
+		u64 ldisc_rx_stalls;
+		u64 ldisc_reads;
+		u64 ldisc_tx_bytes;
+		u64 ldisc_writes;
+		/* RX push placement, see addi_serial_rx_push() */
+		u64 rx_push_local;
+		u64 rx_push_steered;
+		u64 rx_reader_remote;
+		u64 bridge_bytes;
+		u64 bridge_drops;
+		u64 group_writes;
+		u64 group_bytes;
+		u64 sync_starts;
+		u64 sync_skew_ns;
+		u64 sync_skew_max_ns;
+		u64 resp_matches;
+		u64 resp_bytes;
+		u64 resp_drops;
+		/* addi_raw framing */
+		u64 frames;
+		u64 frame_errors;
+		u64 frame_crc_errors;
+		/* ttyAD console */
+		u64 console_bytes;
+		u64 console_drops;
+		/* PPS edges, see addi_serial_edge() */
+		u64 edges;
+		u64 edge_latency_ns;
+		u64 edge_latency_max_ns;
+		u64 edge_jitter_ns;
+		u64 edge_jitter_max_ns;
+		u64 autobaud_runs;
+		u64 autobaud_steps;
+		u64 autobaud_ms;
+		/* From the board handler seeing the port pending to serving it */
+		u64 isr_services;
+		u64 isr_deferred;
+		u64 isr_wait_ns;
+		u64 isr_wait_max_ns;
+		u32 isr_wait[ADDI_SERIAL_HIST_BUCKETS];
+	} stats;
+};
+
 struct serial_private
 {
 	struct pci_dev *dev;
 	unsigned int nr;
 	struct pci_serial_quirk *quirk;
 	const struct pciserial_board *board;
+	int line_base;
+	struct dentry *debugfs;
+
+	/* IRQ placement, see addi_serial_balance_fn() */
+	struct list_head node;
+	unsigned int irq;
+	int irq_cpu;
+	int irq_new_cpu;
+	atomic64_t irqs;
+	u64 irqs_last;
+	u64 irq_rate;
+	u64 irq_moves;
+
+	/* Allocated when the first port starts capturing */
+	struct addi_capture *cap;
+
+	/*
+	 * Board interrupt handler, see addi_serial_board_irq().  Pending
+	 * ports come from the global interrupt status while gisr_on is
+	 * set, from IIR otherwise; irq_rr rotates each priority level.
+	 */
+	bool irq_owned;
+	unsigned int irq_rr[ADDI_SERIAL_IRQ_PRIOS];
+	void __iomem *gisr;
+	bool gisr_on;
+	unsigned int gisr_miss_run;
+	u64 gisr_reads;
+	u64 gisr_misses;
+
+	struct addi_port *port[ADDI_SERIAL_MAX_PORTS];
 	int line[0];
 };
 
+/*
+ * Deterministic line assignment.  A board listed in slot_map gets the
+ * lines first_line + position * ADDI_SERIAL_MAX_PORTS + port index;
+ * with phys_slot set, boards in a physical (hotplug/ACPI) slot use the
+ * slot number as position.  Anything else falls back to the first free
+ * line handed out by the 8250 core.
+ */
+static char *slot_map[ADDI_SERIAL_MAX_BOARDS];
+static int nr_slot_map;
+module_param_array(slot_map, charp, &nr_slot_map, 0444);
+MODULE_PARM_DESC(slot_map, "Board order as [domain:]bus:slot, one line block per entry");
+
+static int first_line;
+module_param(first_line, int, 0444);
+MODULE_PARM_DESC(first_line, "First tty line used for slot based assignment (default 0)");
+
+static struct dentry *addi_serial_debugfs;
+
+static bool phys_slot;
+module_param(phys_slot, bool, 0444);
+MODULE_PARM_DESC(phys_slot, "Derive line blocks from the physical slot number if not in slot_map");
+
+/*
+ * hrtimer expiry latency is what limits timed TX accuracy.  With a lead
+ * the timer fires that much early and the handler spins to the slot.
+ */
+static unsigned int timed_lead_us;
+module_param(timed_lead_us, uint, 0644);
+MODULE_PARM_DESC(timed_lead_us, "Fire the timed TX timer early and spin to the slot (us, max 100)");
+
+static int ldisc = 29;
+module_param(ldisc, int, 0444);
+MODULE_PARM_DESC(ldisc, "Line discipline number of addi_raw, 0 to disable (default 29)");
+
+static unsigned int ldisc_rx_size = 65536;
+module_param(ldisc_rx_size, uint, 0444);
+MODULE_PARM_DESC(ldisc_rx_size, "addi_raw receive buffer per port in bytes (default 65536)");
+
+/* Every attached port, for lookups that start from a tty */
+static LIST_HEAD(addi_serial_ports);
+static DEFINE_MUTEX(addi_serial_ports_lock);
+
+static char *irq_cpus;
+module_param(irq_cpus, charp, 0444);
+MODULE_PARM_DESC(irq_cpus, "CPUs to spread board interrupts over, as a cpulist (default all online)");
+
+static unsigned int irq_balance_ms = 2000;
+module_param(irq_balance_ms, uint, 0444);
+MODULE_PARM_DESC(irq_balance_ms, "Board IRQ rebalance interval in ms, 0 to disable (default 2000)");
+
+static bool msi;
+module_param(msi, bool, 0444);
+MODULE_PARM_DESC(msi, "Use MSI on boards that support it (default off)");
+
+static unsigned int capture_size = 1 << 20;
+module_param(capture_size, uint, 0444);
+MODULE_PARM_DESC(capture_size, "Traffic capture ring per board in bytes, rounded up to a power of 2 (default 1 MiB)");
+
+static unsigned int gisr_offset = 0x0c;
+module_param(gisr_offset, uint, 0444);
+MODULE_PARM_DESC(gisr_offset, "Global UART interrupt status register in BAR0 of PCIe boards, 0 to disable (default 0x0c)");
+
+/* On while any port captures, so the data path pays nothing otherwise */
+static DEFINE_STATIC_KEY_FALSE(addi_capture_on);
+
+/* Lock order: addi_serial_boards_lock, then addi_serial_ports_lock */
+static struct cpumask addi_irq_mask;
+static LIST_HEAD(addi_serial_boards);
+static DEFINE_MUTEX(addi_serial_boards_lock);
+static void addi_serial_balance_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(addi_serial_balance_work, addi_serial_balance_fn);
+
 static int pci_default_setup(struct serial_private *,
 							 const struct pciserial_board *, struct uart_8250_port *, int);
 
@@ -597,165 +1083,4882 @@ serial_pci_matches(const struct pciserial_board *board,
 		   board->first_offset == guessed->first_offset;
 }
 
-struct serial_private *
-addi_pciserial_init_ports(struct pci_dev *dev, const struct pciserial_board *board)
+/*
+ * Port runtime.  The 8250 core still owns the port; these hooks replace
+ * its interrupt handler and TX refill so that the driver decides what
+ * goes into the FIFO, and all of them run with port->lock held.
+ */
+static void addi_serial_stop_tx(struct uart_8250_port *up)
 {
-	struct uart_8250_port uart;
-	struct serial_private *priv;
-	struct pci_serial_quirk *quirk;
-	int rc, nr_ports, i;
-
-	nr_ports = board->num_ports;
-
-	/*
-	 * Find an init and setup quirks.
-	 */
-	quirk = find_quirk(dev);
-
-	/*
-	 * Run the new-style initialization function.
-	 * The initialization function returns:
-	 *  <0  - error
-	 *   0  - use board->num_ports
-	 *  >0  - number of ports
-	 */
-	if (quirk->init)
+	if (up->ier & UART_IER_THRI)
 	{
-		rc = quirk->init(dev);
-		if (rc < 0)
-		{
-			priv = ERR_PTR(rc);
-			goto err_out;
-		}
-		if (rc)
-			nr_ports = rc;
+		up->ier &= ~UART_IER_THRI;
+		serial_out(up, UART_IER, up->ier);
 	}
+}
 
-	priv = kzalloc(sizeof(struct serial_private) +
-					   sizeof(unsigned int) * nr_ports,
-				   GFP_KERNEL);
-	if (!priv)
-	{
-		priv = ERR_PTR(-ENOMEM);
-		goto err_deinit;
-	}
+static void addi_serial_timed_done(struct addi_port *ap,
+								   struct addi_timed_frame *f)
+{
+	struct addi_serial_timed_report *r;
 
-	priv->dev = dev;
-	priv->quirk = quirk;
+	r = &ap->timed_report[ap->report_head];
+	r->target_ns = ktime_to_ns(f->when);
+	r->launch_ns = ktime_to_ns(f->launch);
+	r->id = f->id;
+	r->len = f->len;
 
-	memset(&uart, 0, sizeof(uart));
-	uart.port.flags = UPF_SKIP_TEST | UPF_BOOT_AUTOCONF | UPF_SHARE_IRQ;
-	uart.port.uartclk = board->base_baud * 16;
-	uart.port.irq = get_pci_irq(dev, board);
-	uart.port.dev = &dev->dev;
+	ap->report_head = (ap->report_head + 1) % ADDI_SERIAL_TIMED_REPORTS;
+	if (ap->report_head == ap->report_tail)
+		ap->report_tail = (ap->report_tail + 1) % ADDI_SERIAL_TIMED_REPORTS;
 
-	for (i = 0; i < nr_ports; i++)
-	{
-		if (quirk->setup(priv, board, &uart, i))
-			break;
+	list_del(&f->node);
+	ap->timed_count--;
+	kfree(f);
+}
 
-		dev_dbg(&dev->dev, "Setup PCI port: port %lx, irq %d, type %d\n",
-				uart.port.iobase, uart.port.irq, uart.port.iotype);
+static void addi_capture_copy(struct addi_capture *cap, u64 pos,
+							  const void *src, unsigned int len)
+{
+	u32 off = pos & (cap->size - 1);
+	u32 n = min(len, cap->size - off);
 
-		priv->line[i] = serial8250_register_8250_port(&uart);
-		if (priv->line[i] < 0)
-		{
-			dev_err(&dev->dev,
-					"Couldn't register serial port %lx, irq %d, type %d, error %d\n",
-					uart.port.iobase, uart.port.irq,
-					uart.port.iotype, priv->line[i]);
-			break;
-		}
-	}
-	priv->nr = i;
-	priv->board = board;
-	return priv;
+	memcpy(cap->buf + off, src, n);
+	memcpy(cap->buf, src + n, len - n);
+}
 
-err_deinit:
-	if (quirk->exit)
-		quirk->exit(dev);
-err_out:
-	return priv;
+static void addi_capture_peek(struct addi_capture *cap, u64 pos, void *dst,
+							  unsigned int len)
+{
+	u32 off = pos & (cap->size - 1);
+	u32 n = min(len, cap->size - off);
+
+	memcpy(dst, cap->buf + off, n);
+	memcpy(dst + n, cap->buf, len - n);
 }
-EXPORT_SYMBOL_GPL(addi_pciserial_init_ports);
 
-static void pciserial_detach_ports(struct serial_private *priv)
+/*
+ * Write the staged burst to the board's capture ring, overwriting the
+ * oldest records as needed.  Called with port->lock held.
+ */
+static void addi_capture_flush(struct addi_port *ap)
 {
-	struct pci_serial_quirk *quirk;
-	int i;
+	struct addi_capture *cap = ap->priv->cap;
+	struct addi_cap_rec rec, old;
+	u32 need;
 
-	for (i = 0; i < priv->nr; i++)
-		serial8250_unregister_port(priv->line[i]);
+	if (!ap->cap_len)
+		return;
 
-	/*
-	 * Find the exit quirks.
-	 */
-	quirk = find_quirk(priv->dev);
-	if (quirk->exit)
-		quirk->exit(priv->dev);
+	rec.ts = ap->cap_ts;
+	rec.len = ap->cap_len;
+	rec.port = ap->idx;
+	rec.flags = ap->cap_flags;
+	need = sizeof(rec) + rec.len;
+
+	/* Interrupts are off under the port lock */
+	spin_lock(&cap->lock);
+	while (cap->head + need - cap->tail > cap->size)
+	{
+		addi_capture_peek(cap, cap->tail, &old, sizeof(old));
+		cap->tail += sizeof(old) + old.len;
+		cap->overwritten++;
+	}
+	addi_capture_copy(cap, cap->head, &rec, sizeof(rec));
+	addi_capture_copy(cap, cap->head + sizeof(rec), ap->cap_buf, rec.len);
+	cap->head += need;
+	cap->records++;
+	spin_unlock(&cap->lock);
+
+	ap->cap_len = 0;
+	ap->cap_flags = 0;
 }
 
-void addi_pciserial_remove_ports(struct serial_private *priv)
+/* Stage one byte; @flags is ADDI_SERIAL_CAP_TX or the byte's LSR errors */
+static void addi_capture_byte(struct addi_port *ap, unsigned char ch,
+							  u8 flags)
 {
-	pciserial_detach_ports(priv);
-	kfree(priv);
+	if (ap->cap_len && ((ap->cap_flags ^ flags) & ADDI_SERIAL_CAP_TX))
+		addi_capture_flush(ap);
+	if (!ap->cap_len)
+		ap->cap_ts = ktime_get_real_ns();
+	ap->cap_buf[ap->cap_len++] = ch;
+	ap->cap_flags |= flags;
+	if (ap->cap_len == ADDI_CAPTURE_BURST)
+		addi_capture_flush(ap);
 }
-EXPORT_SYMBOL_GPL(addi_pciserial_remove_ports);
 
-void addi_pciserial_suspend_ports(struct serial_private *priv)
+static inline bool addi_capturing(struct addi_port *ap)
 {
-	int i;
+	return static_branch_unlikely(&addi_capture_on) && ap->capture;
+}
 
-	for (i = 0; i < priv->nr; i++)
-		if (priv->line[i] >= 0)
-			serial8250_suspend_port(priv->line[i]);
+/* Load one byte into the TX FIFO.  Called with port->lock held. */
+static inline void addi_serial_tx_byte(struct addi_port *ap, unsigned char ch)
+{
+	serial_out(ap->up, UART_TX, ch);
+	ap->up->port.icount.tx++;
+	if (addi_capturing(ap))
+		addi_capture_byte(ap, ch, ADDI_SERIAL_CAP_TX);
+}
 
-	/*
-	 * Ensure that every init quirk is properly torn down
-	 */
-	if (priv->quirk->exit)
-		priv->quirk->exit(priv->dev);
+static int addi_serial_tx_timed(struct uart_8250_port *up, int count)
+{
+	struct addi_port *ap = up->port.private_data;
+	struct addi_timed_frame *f;
+
+	while (count > 0 && !list_empty(&ap->timed_active))
+	{
+		f = list_first_entry(&ap->timed_active, struct addi_timed_frame,
+							 node);
+		if (!f->pos)
+			f->launch = ktime_get();
+
+		while (count > 0 && f->pos < f->len)
+		{
+			addi_serial_tx_byte(ap, f->data[f->pos++]);
+			count--;
+		}
+
+		if (f->pos == f->len)
+			addi_serial_timed_done(ap, f);
+	}
+
+	return count;
 }
-EXPORT_SYMBOL_GPL(addi_pciserial_suspend_ports);
 
-void addi_pciserial_resume_ports(struct serial_private *priv)
+/*
+ * The FIFO is only refilled once it is empty, so the n bytes just
+ * loaded go on the wire straight after whatever drain_end covered.
+ */
+static void addi_serial_tx_account(struct addi_port *ap, unsigned int n)
 {
-	int i;
+	ktime_t now = ktime_get();
 
-	/*
-	 * Ensure that the board is correctly configured.
-	 */
-	if (priv->quirk->init)
-		priv->quirk->init(priv->dev);
+	if (ktime_before(ap->drain_end, now))
+		ap->drain_end = now;
+	ap->drain_end = ktime_add_ns(ap->drain_end, n * ap->char_ns);
+}
 
-	for (i = 0; i < priv->nr; i++)
-		if (priv->line[i] >= 0)
-			serial8250_resume_port(priv->line[i]);
+static inline u32 addi_tx_ring_count(struct addi_tx_ring *ring)
+{
+	return READ_ONCE(ring->head) - READ_ONCE(ring->tail);
 }
-EXPORT_SYMBOL_GPL(addi_pciserial_resume_ports);
 
 /*
- * Probe one serial board.  Unfortunately, there is no rhyme nor reason
- * to the arrangement of serial ports on a PCI card.
+ * Producer side: copy in as much as fits and publish it.  Called with
+ * ap->tx_prod_lock held.
  */
-static int
-pciserial_init_one(struct pci_dev *dev, const struct pci_device_id *ent)
+static u32 addi_tx_ring_put(struct addi_tx_ring *ring,
+							const unsigned char *buf, u32 len)
 {
-	struct pci_serial_quirk *quirk;
-	struct serial_private *priv;
-	const struct pciserial_board *board;
-	struct pciserial_board tmp;
-	int rc;
+	u32 tail = smp_load_acquire(&ring->tail);
+	u32 head = ring->head;
+	u32 n, off, done = 0;
 
-	quirk = find_quirk(dev);
-	if (quirk->probe)
+	while (done < len)
 	{
-		rc = quirk->probe(dev);
-		if (rc)
-			return rc;
+		off = head & (ring->size - 1);
+		n = min(len - done, ring->size - (head - tail));
+		n = min(n, ring->size - off);
+		if (!n)
+			break;
+
+		memcpy(ring->buf + off, buf + done, n);
+		head += n;
+		done += n;
 	}
 
-	if (ent->driver_data >= ARRAY_SIZE(pci_boards))
+	smp_store_release(&ring->head, head);
+	return done;
+}
+
+/*
+ * Move as much of the xmit circ buffer into the TX ring as fits.
+ * Called with port->lock held.  A busy producer lock means a writer
+ * is filling the ring and will restart TX; xmit is left for the next
+ * refill rather than spinning in the interrupt path.
+ */
+static void addi_serial_tx_spill(struct addi_port *ap)
+{
+	struct circ_buf *xmit = &ap->up->port.state->xmit;
+	u32 cnt, n;
+
+	if (uart_circ_empty(xmit))
+		return;
+
+	if (spin_trylock(&ap->tx_prod_lock))
+	{
+		do
+		{
+			cnt = CIRC_CNT_TO_END(xmit->head, xmit->tail, UART_XMIT_SIZE);
+			n = addi_tx_ring_put(&ap->ring,
+								 (unsigned char *)xmit->buf + xmit->tail, cnt);
+			xmit->tail = (xmit->tail + n) & (UART_XMIT_SIZE - 1);
+		} while (n == cnt && !uart_circ_empty(xmit));
+		spin_unlock(&ap->tx_prod_lock);
+	}
+	else
+		ap->stats.tx_spill_busy++;
+
+	if (!uart_circ_empty(xmit))
+		ap->tx_writer_blocked = true;
+}
+
+/*
+ * Wake writers.  With a watermark set, only a writer that found the
+ * ring full is woken, and only once the watermark is free again.
+ */
+static void addi_serial_tx_wakeup(struct addi_port *ap)
+{
+	struct uart_port *port = &ap->up->port;
+	struct addi_tx_ring *ring = &ap->ring;
+	unsigned int pct = READ_ONCE(ap->tx_wake_pct);
+
+	if (uart_circ_chars_pending(&port->state->xmit) >= WAKEUP_CHARS)
+		return;
+
+	if (pct)
+	{
+		/* Pairs with the barrier in addi_serial_ring_write() */
+		smp_mb();
+		if (!READ_ONCE(ap->tx_writer_blocked))
+			return;
+		if ((u64)(ring->size - addi_tx_ring_count(ring)) * 100 <
+			(u64)ring->size * pct)
+			return;
+		ap->tx_writer_blocked = false;
+	}
+
+	ap->stats.tx_wakeups++;
+	uart_write_wakeup(port);
+}
+
+static void addi_bcast_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct addi_bcast_buf, ref));
+}
+
+/*
+ * Load up to @count bytes of queued group writes.  Returns the FIFO
+ * space left.  Called with port->lock held.
+ */
+static int addi_serial_tx_bcast(struct addi_port *ap, int count)
+{
+	struct addi_bcast_buf *buf;
+	unsigned int slot;
+
+	while (count > 0 && ap->bcast_tail != ap->bcast_head)
+	{
+		slot = ap->bcast_tail % ADDI_SERIAL_BCAST_QUEUE;
+		buf = ap->bcast[slot].buf;
+		while (count > 0 && ap->bcast[slot].pos < buf->len)
+		{
+			addi_serial_tx_byte(ap, buf->data[ap->bcast[slot].pos++]);
+			count--;
+		}
+		if (ap->bcast[slot].pos < buf->len)
+			break;
+
+		ap->bcast[slot].buf = NULL;
+		ap->bcast_tail++;
+		kref_put(&buf->ref, addi_bcast_release);
+	}
+
+	return count;
+}
+
+/* Drop queued group writes; called with port->lock held */
+static void addi_serial_bcast_flush(struct addi_port *ap)
+{
+	unsigned int slot;
+
+	while (ap->bcast_tail != ap->bcast_head)
+	{
+		slot = ap->bcast_tail++ % ADDI_SERIAL_BCAST_QUEUE;
+		kref_put(&ap->bcast[slot].buf->ref, addi_bcast_release);
+		ap->bcast[slot].buf = NULL;
+	}
+	ap->bcast_hold = false;
+}
+
+/*
+ * ttyAD console ring.  console_lock serialises the writers, so it has
+ * a single producer; the TX refill of the console port consumes it.
+ */
+#define ADDI_CONSOLE_RING 16384
+
+static unsigned char addi_con_buf[ADDI_CONSOLE_RING];
+static struct addi_tx_ring addi_con_ring = {
+	.buf = addi_con_buf,
+	.size = ADDI_CONSOLE_RING,
+};
+static struct addi_port *addi_con_port;
+
+static bool addi_console_pending(struct addi_port *ap)
+{
+	return READ_ONCE(addi_con_port) == ap && addi_tx_ring_count(&addi_con_ring);
+}
+
+/* Load console output, returns the FIFO space left.  port->lock held. */
+static int addi_serial_tx_console(struct addi_port *ap, int count)
+{
+	struct addi_tx_ring *ring = &addi_con_ring;
+	u32 head, tail;
+
+	if (READ_ONCE(addi_con_port) != ap)
+		return count;
+
+	head = smp_load_acquire(&ring->head);
+	tail = ring->tail;
+	while (count > 0 && head != tail)
+	{
+		addi_serial_tx_byte(ap, ring->buf[tail & (ring->size - 1)]);
+		ap->stats.console_bytes++;
+		tail++;
+		count--;
+	}
+	smp_store_release(&ring->tail, tail);
+
+	return count;
+}
+
+static void addi_serial_tx_chars(struct uart_8250_port *up)
+{
+	struct uart_port *port = &up->port;
+	struct addi_port *ap = port->private_data;
+	struct circ_buf *urgent = &ap->urgent;
+	struct addi_tx_ring *ring = &ap->ring;
+	u32 head, tail;
+	int count;
+
+	if (ap->tx_hold || ap->bcast_hold || ap->sync_armed)
+	{
+		addi_serial_stop_tx(up);
+		return;
+	}
+	if (port->x_char)
+	{
+		addi_serial_tx_byte(ap, port->x_char);
+		port->x_char = 0;
+		addi_serial_tx_account(ap, 1);
+		if (addi_capturing(ap))
+			addi_capture_flush(ap);
+		return;
+	}
+	if (uart_tx_stopped(port))
+	{
+		addi_serial_stop_tx(up);
+		return;
+	}
+
+	count = addi_serial_tx_timed(up, up->tx_loadsz);
+	count = addi_serial_tx_console(ap, count);
+	while (count > 0 &&
+		   CIRC_CNT(urgent->head, urgent->tail, ADDI_SERIAL_URGENT_SIZE))
+	{
+		addi_serial_tx_byte(ap, urgent->buf[urgent->tail]);
+		urgent->tail = (urgent->tail + 1) & (ADDI_SERIAL_URGENT_SIZE - 1);
+		count--;
+	}
+	count = addi_serial_tx_bcast(ap, count);
+	addi_serial_tx_spill(ap);
+	head = smp_load_acquire(&ring->head);
+	tail = ring->tail;
+	while (count > 0 && head != tail)
+	{
+		addi_serial_tx_byte(ap, ring->buf[tail & (ring->size - 1)]);
+		tail++;
+		count--;
+	}
+	smp_store_release(&ring->tail, tail);
+	addi_serial_tx_spill(ap);
+
+	addi_serial_tx_account(ap, up->tx_loadsz - count);
+	addi_serial_tx_wakeup(ap);
+	if (addi_capturing(ap))
+		addi_capture_flush(ap);
+
+	if (!addi_tx_ring_count(ring) && urgent->head == urgent->tail &&
+		list_empty(&ap->timed_active) && ap->bcast_head == ap->bcast_tail &&
+		!addi_console_pending(ap) && uart_circ_empty(&port->state->xmit))
+	{
+		addi_serial_stop_tx(up);
+		/*
+		 * A lockless writer that still saw THRI set counts on us to
+		 * send its data.  Pairs with addi_serial_ring_write().
+		 */
+		smp_mb();
+		if (addi_tx_ring_count(ring))
+			ap->orig_ops->start_tx(port);
+		else if (ap->char_ns)
+			hrtimer_start(&ap->drain_timer, ap->drain_end, HRTIMER_MODE_ABS);
+	}
+}
+
+/*
+ * Auto-responder, called for each received byte.  A frame that matches
+ * an entry gets its reply put on the urgent lane, which the TX refill
+ * right after RX in addi_serial_port_service() loads into the FIFO.
+ * The match is decided on the frame's last byte, not at the gap, so
+ * entries must cover the whole request including its CRC; a match with
+ * more bytes already in the RX FIFO is a longer frame and is refused.
+ * Called with port->lock held.
+ */
+static void addi_serial_resp_rx(struct addi_port *ap, unsigned char ch,
+								char flag)
+{
+	struct circ_buf *urgent = &ap->urgent;
+	const struct addi_serial_response *e;
+	unsigned char reply[ADDI_SERIAL_RESP_REPLY_LEN + 2];
+	unsigned int i, j, len;
+	unsigned char lsr;
+	u16 crc;
+
+	if (flag != TTY_NORMAL)
+	{
+		ap->resp_len = 0;
+		return;
+	}
+	/* Too long for any entry: wait for the gap */
+	if (ap->resp_len == ADDI_SERIAL_RESP_MATCH_LEN)
+		return;
+	ap->resp_frame[ap->resp_len++] = ch;
+
+	for (i = 0; i < ap->resp->count; i++)
+	{
+		e = &ap->resp->e[i];
+		if (e->match_len != ap->resp_len)
+			continue;
+		for (j = 0; j < ap->resp_len; j++)
+			if ((ap->resp_frame[j] ^ e->match[j]) & e->mask[j])
+				break;
+		if (j == ap->resp_len)
+			break;
+	}
+	if (i == ap->resp->count)
+		return;
+
+	lsr = serial_in(ap->up, UART_LSR);
+	ap->up->lsr_saved_flags |= lsr & UART_LSR_BRK_ERROR_BITS;
+	if (lsr & UART_LSR_DR)
+		return;
+
+	len = e->reply_len;
+	memcpy(reply, e->reply, len);
+	for (j = 0; j < e->ncopy; j++)
+		memcpy(reply + e->copy[j].to, ap->resp_frame + e->copy[j].from,
+			   e->copy[j].len);
+	if (e->flags & ADDI_SERIAL_RESP_MODBUS_CRC)
+	{
+		crc = crc16(0xffff, reply, len);
+		reply[len++] = crc & 0xff;
+		reply[len++] = crc >> 8;
+	}
+	ap->resp_len = 0;
+	ap->stats.resp_matches++;
+
+	if (CIRC_SPACE(urgent->head, urgent->tail, ADDI_SERIAL_URGENT_SIZE) < len)
+	{
+		ap->stats.resp_drops++;
+		return;
+	}
+	for (j = 0; j < len; j++)
+	{
+		urgent->buf[urgent->head] = reply[j];
+		urgent->head = (urgent->head + 1) & (ADDI_SERIAL_URGENT_SIZE - 1);
+	}
+	ap->stats.resp_bytes += len;
+	if (!uart_tx_stopped(&ap->up->port))
+		ap->up->port.ops->start_tx(&ap->up->port);
+}
+
+static void addi_serial_update_char_ns(struct addi_port *ap,
+									   struct ktermios *termios)
+{
+	struct uart_port *port = &ap->up->port;
+	unsigned int baud, bits;
+	unsigned long flags;
+
+	/* The baud rate actually programmed is encoded in termios */
+	baud = tty_termios_baud_rate(termios);
+	if (!baud)
+		return;
+
+	switch (termios->c_cflag & CSIZE)
+	{
+	case CS5:
+		bits = 5;
+		break;
+	case CS6:
+		bits = 6;
+		break;
+	case CS7:
+		bits = 7;
+		break;
+	default:
+		bits = 8;
+		break;
+	}
+	bits += 2;
+	if (termios->c_cflag & CSTOPB)
+		bits++;
+	if (termios->c_cflag & PARENB)
+		bits++;
+
+	/*
+	 * uart_wait_until_sent() gives up after twice port->timeout, which
+	 * the core sizes for the FIFO alone.  Add the time a full TX ring
+	 * takes, so close() and tcdrain() wait for the ring too; close()
+	 * stays bounded by closing_wait.
+	 */
+	spin_lock_irqsave(&port->lock, flags);
+	ap->char_ns = div_u64((u64)bits * NSEC_PER_SEC, baud);
+	uart_update_timeout(port, termios->c_cflag, baud);
+	port->timeout += nsecs_to_jiffies((u64)ap->ring.size * ap->char_ns);
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+/*
+ * Autobaud.  A byte sent much slower than the receiver runs nearly
+ * always ends in a framing error, since its first low bit still holds
+ * the line low where the stop bit is sampled; so the rates are tried
+ * from fast to slow, two bytes per failed rate.  A rate only a small
+ * multiple too fast can still give clean bytes for some data, so a
+ * candidate must pass a second window after the receiver was resynced
+ * to a fresh start bit; a sync character rules it out best.
+ */
+static const unsigned int addi_autobaud_rates[] = {
+	921600, 460800, 230400, 115200, 57600, 38400, 19200, 9600, 4800, 2400,
+	1200, 600, 300,
+};
+
+/* Divisor for @baud if the UART clock gets within 2% of it, else 0 */
+static unsigned int addi_serial_autobaud_quot(struct uart_port *port,
+											  unsigned int baud)
+{
+	unsigned int quot = DIV_ROUND_CLOSEST(port->uartclk, 16 * baud);
+	unsigned int real;
+
+	if (!quot || quot > 0xffff)
+		return 0;
+	real = port->uartclk / (16 * quot);
+	if (abs((int)real - (int)baud) * 50 > baud)
+		return 0;
+	return quot;
+}
+
+/*
+ * Program the next usable rate from ab_idx on.  Fails if the UART clock
+ * gives none of the rates.  port->lock held.
+ */
+static int addi_serial_autobaud_set(struct addi_port *ap)
+{
+	struct uart_8250_port *up = ap->up;
+	unsigned int quot = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(addi_autobaud_rates); i++)
+	{
+		quot = addi_serial_autobaud_quot(&up->port,
+										 addi_autobaud_rates[ap->ab_idx]);
+		if (quot)
+			break;
+		ap->ab_idx = (ap->ab_idx + 1) % ARRAY_SIZE(addi_autobaud_rates);
+	}
+	if (!quot)
+		return -EINVAL;
+
+	serial_out(up, UART_LCR, up->lcr | UART_LCR_DLAB);
+	serial_dl_write(up, quot);
+	serial_out(up, UART_LCR, up->lcr);
+	serial_out(up, UART_FCR, up->fcr | UART_FCR_CLEAR_RCVR);
+	ap->ab_good = 0;
+	ap->ab_skip = true;
+	ap->ab_confirm = false;
+	return 0;
+}
+
+/* One received byte while detecting.  Called with port->lock held. */
+static void addi_serial_autobaud_rx(struct addi_port *ap, unsigned char ch,
+									unsigned int lsr)
+{
+	if (ap->ab_skip)
+	{
+		ap->ab_skip = false;
+		return;
+	}
+
+	if (!(lsr & (UART_LSR_FE | UART_LSR_PE | UART_LSR_BI)) &&
+		(ap->ab_sync < 0 || ch == ap->ab_sync))
+	{
+		if (++ap->ab_good < ap->ab_need)
+			return;
+		if (!ap->ab_confirm)
+		{
+			/* Drop what is queued and start over on the next start bit */
+			serial_out(ap->up, UART_FCR, ap->up->fcr | UART_FCR_CLEAR_RCVR);
+			ap->ab_good = 0;
+			ap->ab_skip = true;
+			ap->ab_confirm = true;
+			return;
+		}
+		ap->ab_active = false;
+		complete(&ap->ab_done);
+		return;
+	}
+
+	/* Wrap around: the sender may have started mid-scan */
+	ap->ab_idx = (ap->ab_idx + 1) % ARRAY_SIZE(addi_autobaud_rates);
+	ap->stats.autobaud_steps++;
+	/* Cannot fail, the ioctl found a usable rate */
+	addi_serial_autobaud_set(ap);
+}
+
+/*
+ * Make the detected rate the tty's.  Not from the ioctl itself: that
+ * runs under the tty_port mutex, which tty_set_termios() takes too.
+ */
+static void addi_serial_autobaud_apply(struct work_struct *work)
+{
+	struct addi_port *ap = container_of(work, struct addi_port, ab_work);
+	struct tty_struct *tty;
+	struct ktermios termios;
+
+	tty = tty_port_tty_get(&ap->up->port.state->port);
+	if (!tty)
+		return;
+
+	termios = tty->termios;
+	tty_termios_encode_baud_rate(&termios, ap->ab_baud, ap->ab_baud);
+	tty_set_termios(tty, &termios);
+	tty_kref_put(tty);
+}
+
+static int addi_serial_autobaud(struct addi_port *ap,
+								struct addi_serial_autobaud __user *argp)
+{
+	struct uart_8250_port *up = ap->up;
+	struct uart_port *port = &up->port;
+	struct addi_serial_autobaud req;
+	struct ktermios termios;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	unsigned int quot;
+	long left;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (!req.good)
+		req.good = 2;
+	/* The timeout limit is explained at addi_serial_ioctl() */
+	if (!req.timeout_ms || req.timeout_ms > ADDI_SERIAL_AUTOBAUD_MAX_MS ||
+		req.good > 64 ||
+		req.sync < -1 || req.sync > 0xff)
+		return -EINVAL;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->state != ADDI_PORT_ACTIVE || ap->ab_active)
+	{
+		spin_unlock_irqrestore(&port->lock, flags);
+		return -EBUSY;
+	}
+	serial_out(up, UART_LCR, up->lcr | UART_LCR_DLAB);
+	quot = serial_dl_read(up);
+	serial_out(up, UART_LCR, up->lcr);
+
+	reinit_completion(&ap->ab_done);
+	ap->ab_need = req.good;
+	ap->ab_sync = req.sync;
+	ap->ab_idx = 0;
+	if (addi_serial_autobaud_set(ap))
+	{
+		spin_unlock_irqrestore(&port->lock, flags);
+		return -EINVAL;
+	}
+	ap->ab_active = true;
+	ap->stats.autobaud_runs++;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	left = wait_for_completion_interruptible_timeout(&ap->ab_done,
+													 msecs_to_jiffies(req.timeout_ms));
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->ab_active)
+	{
+		ap->ab_active = false;
+		serial_out(up, UART_LCR, up->lcr | UART_LCR_DLAB);
+		serial_dl_write(up, quot);
+		serial_out(up, UART_LCR, up->lcr);
+		ret = left < 0 ? -EINTR : -ETIMEDOUT;
+	}
+	else
+	{
+		ap->ab_baud = addi_autobaud_rates[ap->ab_idx];
+	}
+	ap->stats.autobaud_ms = ktime_ms_delta(ktime_get(), start);
+	spin_unlock_irqrestore(&port->lock, flags);
+	if (ret)
+		return ret;
+
+	/*
+	 * The UART already runs at the new rate; bring the character time
+	 * and port->timeout along now.  The tty's termios follows from
+	 * ab_work, after we return.
+	 */
+	termios = ap->termios;
+	tty_termios_encode_baud_rate(&termios, ap->ab_baud, ap->ab_baud);
+	addi_serial_update_char_ns(ap, &termios);
+	schedule_work(&ap->ab_work);
+	req.baud = ap->ab_baud;
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Received bytes headed for a bridged port */
+struct addi_rx_fwd
+{
+	struct addi_port *to;
+	bool monitor;
+	unsigned int len;
+	unsigned char buf[256];
+};
+
+/*
+ * serial8250_rx_chars() without the flip buffer push, which is left to
+ * addi_serial_rx_push().  Good bytes are collected in @fwd when the
+ * port is bridged.  At most @budget bytes are read if it is non-zero;
+ * the rest keeps the RX interrupt pending.  Called with port->lock held.
+ */
+static unsigned char addi_serial_rx_chars(struct uart_8250_port *up,
+										  unsigned char lsr,
+										  struct addi_rx_fwd *fwd,
+										  unsigned int budget)
+{
+	struct uart_port *port = &up->port;
+	struct addi_port *ap = port->private_data;
+	int max_count = ARRAY_SIZE(fwd->buf);
+	unsigned char ch;
+	char flag;
+
+	if (budget && budget < max_count)
+		max_count = budget;
+
+	do
+	{
+		ch = lsr & UART_LSR_DR ? serial_in(up, UART_RX) : 0;
+		flag = TTY_NORMAL;
+		port->icount.rx++;
+
+		lsr |= up->lsr_saved_flags;
+		up->lsr_saved_flags = 0;
+		if (addi_capturing(ap))
+			addi_capture_byte(ap, ch, lsr & UART_LSR_BRK_ERROR_BITS);
+		if (unlikely(ap->ab_active))
+		{
+			addi_serial_autobaud_rx(ap, ch, lsr);
+			goto next;
+		}
+
+		if (unlikely(lsr & UART_LSR_BRK_ERROR_BITS))
+		{
+			if (lsr & UART_LSR_BI)
+			{
+				lsr &= ~(UART_LSR_FE | UART_LSR_PE);
+				port->icount.brk++;
+				if (uart_handle_break(port))
+					goto next;
+			}
+			else if (lsr & UART_LSR_PE)
+				port->icount.parity++;
+			else if (lsr & UART_LSR_FE)
+				port->icount.frame++;
+			if (lsr & UART_LSR_OE)
+				port->icount.overrun++;
+
+			lsr &= port->read_status_mask;
+
+			if (lsr & UART_LSR_BI)
+				flag = TTY_BREAK;
+			else if (lsr & UART_LSR_PE)
+				flag = TTY_PARITY;
+			else if (lsr & UART_LSR_FE)
+				flag = TTY_FRAME;
+		}
+		if (uart_handle_sysrq_char(port, ch))
+			goto next;
+		if (ap->resp)
+			addi_serial_resp_rx(ap, ch, flag);
+		if (fwd->to && flag == TTY_NORMAL)
+		{
+			fwd->buf[fwd->len++] = ch;
+			if (!fwd->monitor)
+				goto next;
+		}
+		uart_insert_char(port, lsr, UART_LSR_OE, ch, flag);
+next:
+		if (--max_count == 0)
+		{
+			ap->rx_budget_hit = budget && budget <= ARRAY_SIZE(fwd->buf);
+			break;
+		}
+		lsr = serial_in(up, UART_LSR);
+	} while (lsr & (UART_LSR_DR | UART_LSR_BI));
+
+	return lsr;
+}
+
+static int addi_serial_rx_target(struct addi_port *ap)
+{
+	int cpu = READ_ONCE(ap->rx_cpu);
+
+	if (cpu == ADDI_SERIAL_RX_CPU_AUTO)
+		cpu = READ_ONCE(ap->reader_cpu);
+	if (cpu < 0 || !cpu_online(cpu))
+		return -1;
+	return cpu;
+}
+
+static void addi_serial_rx_work(struct work_struct *work)
+{
+	struct addi_port *ap = container_of(work, struct addi_port, rx_work);
+
+	tty_flip_buffer_push(&ap->up->port.state->port);
+}
+
+/*
+ * Push received data to the line discipline.  tty_flip_buffer_push()
+ * queues flush_to_ldisc() on the unbound workqueue, whose worker runs
+ * on any CPU of the calling CPU's NUMA node.  Only the node can be
+ * chosen this way, not the CPU: when the target is on another node,
+ * make the call from the target CPU so the ldisc work runs on its node.
+ */
+static void addi_serial_rx_push(struct addi_port *ap)
+{
+	int reader = READ_ONCE(ap->reader_cpu);
+	int this = smp_processor_id();
+	int cpu = addi_serial_rx_target(ap);
+
+	if (cpu < 0 || cpu_to_node(cpu) == cpu_to_node(this))
+	{
+		if (reader >= 0 && cpu_to_node(reader) != cpu_to_node(this))
+			ap->stats.rx_reader_remote++;
+		ap->stats.rx_push_local++;
+		tty_flip_buffer_push(&ap->up->port.state->port);
+		return;
+	}
+
+	if (reader >= 0 && cpu_to_node(reader) != cpu_to_node(cpu))
+		ap->stats.rx_reader_remote++;
+	ap->stats.rx_push_steered++;
+
+	queue_work_on(cpu, system_highpri_wq, &ap->rx_work);
+}
+
+/*
+ * Make sure the transmitter runs after data was put into the ring
+ * without port->lock.  While THRI is set the refill will find it, and
+ * it re-checks the ring after clearing THRI; otherwise restart TX under
+ * port->lock.  Returns true if the lock was not needed.
+ */
+static bool addi_serial_tx_kick(struct addi_port *ap)
+{
+	struct uart_port *port = &ap->up->port;
+	unsigned long flags;
+
+	/* Pairs with the barriers in addi_serial_tx_chars() */
+	smp_mb();
+	if (READ_ONCE(ap->up->ier) & UART_IER_THRI)
+		return true;
+
+	if (!spin_trylock_irqsave(&port->lock, flags))
+	{
+		atomic64_inc(&ap->stats.tx_lock_contended);
+		spin_lock_irqsave(&port->lock, flags);
+	}
+	if (!uart_tx_stopped(port))
+		port->ops->start_tx(port);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return false;
+}
+
+/*
+ * Forward what a bridged port received into the TX ring of its peer.
+ * Runs from the source's interrupt handler after its port->lock has
+ * been dropped; a busy producer lock or full ring drops the data.
+ */
+static void addi_serial_bridge_send(struct addi_port *ap,
+									struct addi_rx_fwd *fwd)
+{
+	struct addi_port *to = fwd->to;
+	u32 n = 0;
+
+	if (READ_ONCE(to->state) == ADDI_PORT_ACTIVE &&
+		spin_trylock(&to->tx_prod_lock))
+	{
+		n = addi_tx_ring_put(&to->ring, fwd->buf, fwd->len);
+		spin_unlock(&to->tx_prod_lock);
+	}
+
+	ap->stats.bridge_bytes += n;
+	ap->stats.bridge_drops += fwd->len - n;
+	if (n)
+		addi_serial_tx_kick(to);
+}
+
+/*
+ * Start a new responder frame after a gap of 3.5 characters, the Modbus
+ * RTU frame separator.  Called with port->lock held.
+ */
+static void addi_serial_resp_gap(struct addi_port *ap)
+{
+	ktime_t now = ktime_get();
+
+	if (ktime_to_ns(ktime_sub(now, ap->resp_last)) > ap->char_ns * 7 / 2)
+		ap->resp_len = 0;
+	ap->resp_last = now;
+}
+
+/*
+ * serial8250_modem_status() on an MSR value already read, so the delta
+ * bits seen by addi_serial_edge() are not lost to a second read.
+ */
+static void addi_serial_modem_status(struct uart_8250_port *up,
+									 unsigned int status)
+{
+	struct uart_port *port = &up->port;
+
+	status |= up->msr_saved_flags;
+	up->msr_saved_flags = 0;
+	if (!(status & UART_MSR_ANY_DELTA) || !(up->ier & UART_IER_MSI) ||
+		!port->state)
+		return;
+
+	if (status & UART_MSR_TERI)
+		port->icount.rng++;
+	if (status & UART_MSR_DDSR)
+		port->icount.dsr++;
+	if (status & UART_MSR_DDCD)
+		uart_handle_dcd_change(port, status & UART_MSR_DCD);
+	if (status & UART_MSR_DCTS)
+		uart_handle_cts_change(port, status & UART_MSR_CTS);
+
+	wake_up_interruptible(&port->state->port.delta_msr_wait);
+}
+
+/* Interrupt entry, as seen by PPS and the edge statistics */
+struct addi_irq_stamp
+{
+	struct pps_event_time ts;
+	ktime_t t0;
+};
+
+static void addi_irq_stamp(struct addi_irq_stamp *st)
+{
+	pps_get_ts(&st->ts);
+	st->t0 = ktime_get();
+}
+
+/*
+ * A PPS edge.  @ts and @t0 were taken first thing in the interrupt
+ * handler; the latency is how much later the edge was decoded, which
+ * is what timestamping in the tty layer used to add.  The jitter is the
+ * change in the assert-to-assert period.  Called with port->lock held.
+ */
+static void addi_serial_edge(struct addi_port *ap, unsigned int msr,
+							 struct pps_event_time *ts, ktime_t t0)
+{
+	unsigned int line = ap->pps_delta == UART_MSR_DDCD ? UART_MSR_DCD :
+														 UART_MSR_CTS;
+	u64 latency = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	s64 period;
+	u64 jitter;
+
+	pps_event(ap->pps, ts, msr & line ? PPS_CAPTUREASSERT : PPS_CAPTURECLEAR,
+			  NULL);
+
+	ap->stats.edges++;
+	ap->stats.edge_latency_ns = latency;
+	ap->stats.edge_latency_max_ns = max(ap->stats.edge_latency_max_ns, latency);
+	if (!(msr & line))
+		return;
+
+	if (ap->edge_last)
+	{
+		period = ktime_to_ns(ktime_sub(t0, ap->edge_last));
+		if (ap->edge_period)
+		{
+			jitter = abs(period - ap->edge_period);
+			ap->stats.edge_jitter_ns = jitter;
+			ap->stats.edge_jitter_max_ns = max(ap->stats.edge_jitter_max_ns,
+											   jitter);
+		}
+		ap->edge_period = period;
+	}
+	ap->edge_last = t0;
+}
+
+static void addi_serial_hist_ns(u32 *hist, s64 ns)
+{
+	s64 us = div_s64(ns, NSEC_PER_USEC);
+
+	hist[min(us > 0 ? fls64(us) : 0, ADDI_SERIAL_HIST_BUCKETS - 1)]++;
+}
+
+static void addi_serial_hist_add(u32 *hist, ktime_t start)
+{
+	addi_serial_hist_ns(hist, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/*
+ * Service a port whose IIR read @iir, with an RX budget as above.  @st
+ * is when the interrupt came in, NULL if nobody stamped it because no
+ * port wanted edges then.
+ */
+static void addi_serial_port_service(struct uart_port *port, unsigned int iir,
+									 unsigned int budget,
+									 struct addi_irq_stamp *st)
+{
+	struct uart_8250_port *up = up_to_u8250p(port);
+	struct addi_port *ap = port->private_data;
+	struct addi_rx_fwd fwd;
+	unsigned char status;
+	unsigned long flags;
+	unsigned int msr;
+
+	rcu_read_lock();
+	fwd.to = rcu_dereference(ap->bridge);
+	fwd.monitor = READ_ONCE(ap->bridge_monitor);
+	fwd.len = 0;
+
+	spin_lock_irqsave(&port->lock, flags);
+
+	ap->rx_budget_hit = false;
+	status = serial_port_in(port, UART_LSR);
+	if (status & (UART_LSR_DR | UART_LSR_BI))
+	{
+		if (ap->resp)
+			addi_serial_resp_gap(ap);
+		status = addi_serial_rx_chars(up, status, &fwd, budget);
+		if (addi_capturing(ap))
+			addi_capture_flush(ap);
+		addi_serial_rx_push(ap);
+		/* The sender went quiet: whatever comes next is a new frame */
+		if ((iir & UART_IIR_ID) == UART_IIR_RX_TIMEOUT)
+			ap->resp_len = 0;
+	}
+	msr = serial_port_in(port, UART_MSR);
+	if (st && msr & READ_ONCE(ap->pps_delta))
+		addi_serial_edge(ap, msr, &st->ts, st->t0);
+	addi_serial_modem_status(up, msr);
+	if (status & UART_LSR_THRE)
+		addi_serial_tx_chars(up);
+
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	/* Only now, so two bridged ports never hold both port locks */
+	if (fwd.len)
+		addi_serial_bridge_send(ap, &fwd);
+	rcu_read_unlock();
+}
+
+static int addi_serial_port_irq(struct uart_port *port)
+{
+	struct addi_port *ap = port->private_data;
+	struct addi_irq_stamp st;
+	bool edges;
+	unsigned int iir;
+
+	/* Before anything else, so PPS edges are stamped as early as can be */
+	edges = READ_ONCE(ap->pps_delta);
+	if (edges)
+		addi_irq_stamp(&st);
+
+	iir = serial_port_in(port, UART_IIR);
+	if (iir & UART_IIR_NO_INT)
+		return 0;
+
+	addi_serial_port_service(port, iir, 0, edges ? &st : NULL);
+	return 1;
+}
+
+/* The 8250 core's chain, idle while the board handler owns the line */
+static int addi_serial_handle_irq(struct uart_port *port)
+{
+	struct addi_port *ap = port->private_data;
+
+	if (READ_ONCE(ap->priv->irq_owned))
+		return 0;
+	if (!addi_serial_port_irq(port))
+		return 0;
+	/* Once per port served; the core does not tell us the interrupt */
+	atomic64_inc(&ap->priv->irqs);
+	return 1;
+}
+
+/*
+ * Board interrupt handler.  It owns the line of every board with an
+ * interrupt and the 8250 core's per-port chain stands by.  On the PCIe
+ * boards a global interrupt status register in BAR0, below the first
+ * UART, tells which ports are pending with one read; other boards, or
+ * PCIe boards whose register proved unreliable, read IIR of each open
+ * port.  Pending ports are served by priority, round-robin within a
+ * level, and each with its RX budget, until none is left pending.
+ */
+#define ADDI_SERIAL_IRQ_PASSES 64
+#define ADDI_SERIAL_GISR_MISSES 16
+
+/* Cold ports have no IRQ linked in the 8250 core either */
+static bool addi_serial_irq_live(struct addi_port *ap)
+{
+	return ap && READ_ONCE(ap->state) != ADDI_PORT_COLD;
+}
+
+static unsigned long addi_serial_board_pending(struct serial_private *priv,
+											   bool gisr, unsigned int *iir)
+{
+	unsigned long pending = GENMASK(priv->nr - 1, 0);
+	struct addi_port *ap;
+	int i;
+
+	if (gisr)
+	{
+		pending &= readl(priv->gisr);
+		priv->gisr_reads++;
+		if (pending)
+			priv->gisr_miss_run = 0;
+	}
+
+	for_each_set_bit(i, &pending, priv->nr)
+	{
+		ap = priv->port[i];
+		if (!addi_serial_irq_live(ap))
+		{
+			__clear_bit(i, &pending);
+			continue;
+		}
+		iir[i] = serial_port_in(&ap->up->port, UART_IIR);
+		if (iir[i] & UART_IIR_NO_INT)
+			__clear_bit(i, &pending);
+	}
+
+	return pending;
+}
+
+static void addi_serial_isr_wait(struct addi_port *ap, ktime_t seen)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), seen));
+
+	ap->stats.isr_services++;
+	ap->stats.isr_wait_ns += ns;
+	ap->stats.isr_wait_max_ns = max(ap->stats.isr_wait_max_ns, ns);
+	addi_serial_hist_ns(ap->stats.isr_wait, ns);
+}
+
+/*
+ * @seen[i] is when port i was first found pending.  With @drain set the
+ * budgets are ignored, for the handler's last pass.  Returns the ports
+ * that ran out of RX budget.
+ */
+static unsigned long addi_serial_board_service(struct serial_private *priv,
+											   unsigned long pending,
+											   const unsigned int *iir,
+											   const ktime_t *seen,
+											   struct addi_irq_stamp *st,
+											   bool drain)
+{
+	unsigned long level[ADDI_SERIAL_IRQ_PRIOS] = { 0 };
+	unsigned long left = 0;
+	struct addi_port *ap;
+	unsigned int budget;
+	int prio, first, n, i;
+
+	for_each_set_bit(i, &pending, priv->nr)
+		level[min_t(unsigned int, READ_ONCE(priv->port[i]->irq_prio),
+					ADDI_SERIAL_IRQ_PRIOS - 1)] |= BIT(i);
+
+	for (prio = ADDI_SERIAL_IRQ_PRIOS - 1; prio >= 0; prio--)
+	{
+		if (!level[prio])
+			continue;
+
+		/* Start one past where this level started last time */
+		first = -1;
+		for (n = 0; n < priv->nr; n++)
+		{
+			i = (priv->irq_rr[prio] + n) % priv->nr;
+			if (!(level[prio] & BIT(i)))
+				continue;
+			if (first < 0)
+				first = i;
+
+			ap = priv->port[i];
+			addi_serial_isr_wait(ap, seen[i]);
+			budget = drain ? 0 : READ_ONCE(ap->irq_budget);
+			addi_serial_port_service(&ap->up->port, iir[i], budget, st);
+			if (ap->rx_budget_hit)
+				left |= BIT(i);
+		}
+		priv->irq_rr[prio] = (first + 1) % priv->nr;
+	}
+
+	return left;
+}
+
+/* Whether any port of the board timestamps its modem status edges */
+static bool addi_serial_board_edges(struct serial_private *priv)
+{
+	int i;
+
+	for (i = 0; i < priv->nr; i++)
+		if (priv->port[i] && READ_ONCE(priv->port[i]->pps_delta))
+			return true;
+	return false;
+}
+
+static irqreturn_t addi_serial_board_irq(int irq, void *dev_id)
+{
+	struct serial_private *priv = dev_id;
+	unsigned int iir[ADDI_SERIAL_MAX_PORTS];
+	ktime_t seen[ADDI_SERIAL_MAX_PORTS];
+	unsigned long pending, left = 0;
+	struct addi_irq_stamp st;
+	int pass, i, handled = 0;
+	bool edges, gisr;
+	ktime_t now;
+
+	if (!READ_ONCE(priv->irq_owned))
+		return IRQ_NONE;
+
+	/* Before anything else, so PPS edges are stamped as early as can be */
+	edges = addi_serial_board_edges(priv);
+	if (edges)
+		addi_irq_stamp(&st);
+
+	/* Until nothing is pending, so no MSI edge gets lost */
+	for (pass = 0; pass < ADDI_SERIAL_IRQ_PASSES; pass++)
+	{
+		/* A later pass only finds edges that came in meanwhile */
+		if (edges && pass)
+			addi_irq_stamp(&st);
+		now = ktime_get();
+		gisr = READ_ONCE(priv->gisr_on);
+		pending = addi_serial_board_pending(priv, gisr, iir);
+
+		/*
+		 * Nothing flagged: most likely another device on a shared
+		 * line, but make sure by IIR.  A register that keeps missing
+		 * pending ports is not used any more.
+		 */
+		if (!pending && gisr && !handled)
+		{
+			pending = addi_serial_board_pending(priv, false, iir);
+			if (pending)
+			{
+				priv->gisr_misses++;
+				if (++priv->gisr_miss_run >= ADDI_SERIAL_GISR_MISSES)
+				{
+					WRITE_ONCE(priv->gisr_on, false);
+					dev_warn(&priv->dev->dev,
+							 "global interrupt status unreliable, polling IIR\n");
+				}
+			}
+		}
+		if (!pending)
+			break;
+
+		/*
+		 * Ports whose RX budget ran out last pass waited a whole pass
+		 * more and keep the time they were first seen.  Anything else
+		 * pending again came in meanwhile.
+		 */
+		for_each_set_bit(i, &pending, priv->nr)
+		{
+			if (left & BIT(i))
+				priv->port[i]->stats.isr_deferred++;
+			else
+				seen[i] = now;
+		}
+
+		left = addi_serial_board_service(priv, pending, iir, seen,
+										 edges ? &st : NULL,
+										 pass == ADDI_SERIAL_IRQ_PASSES - 1);
+		handled = 1;
+	}
+
+	if (handled)
+		atomic64_inc(&priv->irqs);
+	return IRQ_RETVAL(handled);
+}
+
+static void addi_serial_gisr_init(struct serial_private *priv,
+								  const struct pciserial_board *board)
+{
+	struct pci_dev *dev = priv->dev;
+	int bar = FL_GET_BASE(board->flags);
+	void __iomem *base;
+	u32 val;
+
+	if (!gisr_offset || board->flags & FL_BASE_BARS ||
+		board->first_offset < gisr_offset + sizeof(u32) ||
+		!(pci_resource_flags(dev, bar) & IORESOURCE_MEM))
+		return;
+
+	base = pcim_iomap_table(dev)[bar];
+	if (!base)
+		return;
+
+	/* All ports are closed, so nothing can be pending yet */
+	val = readl(base + gisr_offset);
+	if (val == U32_MAX || val & GENMASK(priv->nr - 1, 0))
+	{
+		dev_info(&dev->dev, "no usable global interrupt status (0x%08x)\n",
+				 val);
+		return;
+	}
+
+	priv->gisr = base + gisr_offset;
+	priv->gisr_on = true;
+}
+
+static void addi_serial_board_irq_init(struct serial_private *priv,
+									   const struct pciserial_board *board)
+{
+	if (!priv->irq || !priv->nr)
+		return;
+
+	addi_serial_gisr_init(priv, board);
+	if (request_irq(priv->irq, addi_serial_board_irq, IRQF_SHARED,
+					"addi_serial", priv))
+	{
+		dev_warn(&priv->dev->dev, "irq %u: board handler not installed\n",
+				 priv->irq);
+		priv->gisr = NULL;
+		priv->gisr_on = false;
+		return;
+	}
+	WRITE_ONCE(priv->irq_owned, true);
+}
+
+static void addi_serial_board_irq_exit(struct serial_private *priv)
+{
+	if (!priv->irq_owned)
+		return;
+
+	/* The ports' own handlers take over before ours goes */
+	WRITE_ONCE(priv->irq_owned, false);
+	free_irq(priv->irq, priv);
+	priv->gisr = NULL;
+	priv->gisr_on = false;
+}
+
+static bool addi_serial_tx_pending(struct addi_port *ap)
+{
+	return READ_ONCE(ap->ring.head) != READ_ONCE(ap->ring.tail) ||
+		   READ_ONCE(ap->urgent.head) != READ_ONCE(ap->urgent.tail) ||
+		   READ_ONCE(ap->bcast_head) != READ_ONCE(ap->bcast_tail) ||
+		   READ_ONCE(ap->timed_count);
+}
+
+static enum hrtimer_restart addi_serial_drain_fire(struct hrtimer *timer)
+{
+	struct addi_port *ap = container_of(timer, struct addi_port, drain_timer);
+	struct uart_8250_port *up = ap->up;
+	unsigned long flags;
+	unsigned char lsr;
+	s64 overshoot;
+
+	spin_lock_irqsave(&up->port.lock, flags);
+
+	lsr = serial_in(up, UART_LSR);
+	up->lsr_saved_flags |= lsr & UART_LSR_BRK_ERROR_BITS;
+
+	/*
+	 * Still shifting out: the estimate was early, poll again shortly.
+	 * If TX was restarted meanwhile the refill will re-arm us.
+	 */
+	if (!(lsr & UART_LSR_TEMT) && !(up->ier & UART_IER_THRI))
+		hrtimer_start(timer,
+					  ktime_add_ns(ktime_get(),
+								   max_t(u64, ap->char_ns / 4, NSEC_PER_USEC)),
+					  HRTIMER_MODE_ABS);
+
+	if ((lsr & UART_LSR_TEMT) && !addi_serial_tx_pending(ap))
+	{
+		overshoot = ktime_to_ns(ktime_sub(ktime_get(), ap->drain_end));
+		if (overshoot < 0)
+			overshoot = 0;
+		ap->stats.drains++;
+		ap->stats.drain_overshoot_ns += overshoot;
+		if (overshoot > ap->stats.drain_overshoot_max_ns)
+			ap->stats.drain_overshoot_max_ns = overshoot;
+	}
+
+	spin_unlock_irqrestore(&up->port.lock, flags);
+
+	if (lsr & UART_LSR_TEMT)
+		wake_up_all(&ap->drain_wq);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * tx_empty() never sleeps.  uart_wait_until_sent() polls it with
+ * msleep() steps of at least a jiffy, so close() and tcdrain() return
+ * up to one such step after the last stop bit; drain_timer only keeps
+ * the overshoot statistics.  The TX ring is covered by port->timeout, see
+ * addi_serial_update_char_ns().
+ */
+static unsigned int addi_serial_tx_empty(struct uart_port *port)
+{
+	struct addi_port *ap = port->private_data;
+
+	if (addi_serial_tx_pending(ap))
+		return 0;
+	return ap->orig_ops->tx_empty(port);
+}
+
+static void addi_serial_flush_buffer(struct uart_port *port)
+{
+	struct addi_port *ap = port->private_data;
+
+	/* Called by the serial core with port->lock held */
+	ap->urgent.head = ap->urgent.tail = 0;
+	ap->ring.tail = ap->ring.head;
+	addi_serial_bcast_flush(ap);
+	ap->tx_writer_blocked = false;
+	wake_up_all(&ap->drain_wq);
+
+	if (ap->orig_ops->flush_buffer)
+		ap->orig_ops->flush_buffer(port);
+}
+
+static void addi_serial_start_tx(struct uart_port *port)
+{
+	struct addi_port *ap = port->private_data;
+
+	addi_serial_tx_spill(ap);
+	ap->orig_ops->start_tx(port);
+}
+
+/*
+ * Queue data straight into the TX ring, skipping the xmit buffer.
+ * Anything already in xmit goes first.  Returns the bytes taken.
+ * port->lock is only taken when the transmitter is idle.
+ */
+static unsigned int addi_serial_ring_write(struct addi_port *ap,
+										   const unsigned char *buf,
+										   unsigned int len)
+{
+	struct uart_port *port = &ap->up->port;
+	unsigned int done = 0;
+
+	spin_lock(&ap->tx_prod_lock);
+	if (uart_circ_empty(&port->state->xmit))
+		done = addi_tx_ring_put(&ap->ring, buf, len);
+	if (done < len)
+		WRITE_ONCE(ap->tx_writer_blocked, true);
+	spin_unlock(&ap->tx_prod_lock);
+
+	if (addi_serial_tx_kick(ap))
+		ap->stats.tx_writes_lockless++;
+	else
+		ap->stats.tx_writes_locked++;
+
+	return done;
+}
+
+static bool addi_serial_ring_room(struct addi_port *ap)
+{
+	return addi_tx_ring_count(&ap->ring) < ap->ring.size;
+}
+
+static int addi_serial_urgent_write(struct addi_port *ap,
+									struct addi_serial_write __user *argp)
+{
+	struct uart_port *port = &ap->up->port;
+	struct circ_buf *urgent = &ap->urgent;
+	struct addi_serial_write req;
+	unsigned long flags;
+	unsigned char *data;
+	int i, ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.flags)
+		return -EINVAL;
+	if (!req.len)
+		return 0;
+	if (req.len >= ADDI_SERIAL_URGENT_SIZE)
+		return -EMSGSIZE;
+
+	data = memdup_user(u64_to_user_ptr(req.data), req.len);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (CIRC_SPACE(urgent->head, urgent->tail, ADDI_SERIAL_URGENT_SIZE) <
+		req.len)
+	{
+		ret = -EAGAIN;
+	}
+	else
+	{
+		for (i = 0; i < req.len; i++)
+		{
+			urgent->buf[urgent->head] = data[i];
+			urgent->head = (urgent->head + 1) & (ADDI_SERIAL_URGENT_SIZE - 1);
+		}
+		if (!uart_tx_stopped(port))
+			port->ops->start_tx(port);
+		ret = req.len;
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	kfree(data);
+	return ret;
+}
+
+static enum hrtimer_restart addi_serial_timed_fire(struct hrtimer *timer)
+{
+	struct addi_port *ap = container_of(timer, struct addi_port, timed_timer);
+	struct uart_8250_port *up = ap->up;
+	struct uart_port *port = &up->port;
+	struct addi_timed_frame *f, *next;
+	u64 lead = min(timed_lead_us, 100U) * NSEC_PER_USEC;
+	unsigned long flags;
+	ktime_t now;
+
+	spin_lock_irqsave(&port->lock, flags);
+
+	now = ktime_get();
+	list_for_each_entry_safe(f, next, &ap->timed_queue, node)
+	{
+		if (ktime_after(f->when, ktime_add_ns(now, lead)))
+		{
+			/*
+			 * Re-arm rather than return HRTIMER_RESTART: the ioctl
+			 * may already have re-queued the timer for an earlier
+			 * frame while we waited for the lock.
+			 */
+			hrtimer_start(timer, ns_to_ktime(ktime_to_ns(f->when) - lead),
+						  HRTIMER_MODE_ABS);
+			break;
+		}
+		list_move_tail(&f->node, &ap->timed_active);
+	}
+
+	if (!list_empty(&ap->timed_active))
+	{
+		f = list_first_entry(&ap->timed_active, struct addi_timed_frame,
+							 node);
+		while (!f->pos && ktime_before(ktime_get(), f->when))
+			cpu_relax();
+
+		if (!uart_tx_stopped(port) &&
+			(serial_port_in(port, UART_LSR) & UART_LSR_THRE))
+			addi_serial_tx_chars(up);
+		if (!list_empty(&ap->timed_active) && !uart_tx_stopped(port))
+			port->ops->start_tx(port);
+	}
+
+	spin_unlock_irqrestore(&port->lock, flags);
+	return HRTIMER_NORESTART;
+}
+
+static int addi_serial_timed_write(struct addi_port *ap,
+								   struct addi_serial_timed_write __user *argp)
+{
+	struct uart_port *port = &ap->up->port;
+	struct addi_serial_timed_write req;
+	struct addi_timed_frame *f, *pos;
+	u64 lead = min(timed_lead_us, 100U) * NSEC_PER_USEC;
+	unsigned long flags;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (!req.len || req.len > ADDI_SERIAL_TIMED_MAX_LEN)
+		return -EMSGSIZE;
+
+	f = kmalloc(sizeof(*f) + req.len, GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	if (copy_from_user(f->data, u64_to_user_ptr(req.data), req.len))
+	{
+		kfree(f);
+		return -EFAULT;
+	}
+	f->when = ns_to_ktime(req.when_ns);
+	f->id = req.id;
+	f->len = req.len;
+	f->pos = 0;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->timed_count >= ADDI_SERIAL_TIMED_QUEUE)
+	{
+		ret = -EAGAIN;
+	}
+	else
+	{
+		list_for_each_entry(pos, &ap->timed_queue, node)
+			if (ktime_before(f->when, pos->when))
+				break;
+		list_add_tail(&f->node, &pos->node);
+		ap->timed_count++;
+
+		if (list_first_entry(&ap->timed_queue, struct addi_timed_frame,
+							 node) == f)
+			hrtimer_start(&ap->timed_timer,
+						  ns_to_ktime(req.when_ns - lead), HRTIMER_MODE_ABS);
+		f = NULL;
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	kfree(f);
+	return ret;
+}
+
+static int addi_serial_timed_report(struct addi_port *ap,
+									struct addi_serial_timed_report __user *argp)
+{
+	struct uart_port *port = &ap->up->port;
+	struct addi_serial_timed_report r;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->report_head == ap->report_tail)
+	{
+		ret = -EAGAIN;
+	}
+	else
+	{
+		r = ap->timed_report[ap->report_tail];
+		ap->report_tail = (ap->report_tail + 1) % ADDI_SERIAL_TIMED_REPORTS;
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (!ret && copy_to_user(argp, &r, sizeof(r)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Drop every frame that has not been fully loaded into the FIFO.
+ */
+static void addi_serial_timed_flush(struct addi_port *ap)
+{
+	struct uart_port *port = &ap->up->port;
+	struct addi_timed_frame *f, *next;
+	unsigned long flags;
+	LIST_HEAD(dead);
+
+	hrtimer_cancel(&ap->timed_timer);
+
+	spin_lock_irqsave(&port->lock, flags);
+	list_splice_init(&ap->timed_queue, &dead);
+	list_splice_tail_init(&ap->timed_active, &dead);
+	ap->timed_count = 0;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	list_for_each_entry_safe(f, next, &dead, node)
+		kfree(f);
+}
+
+/*
+ * PM QoS for latency-critical ports.  While such a port is open, CPUs
+ * are kept out of C-states whose exit latency exceeds latency_us: all
+ * of them through PM_QOS_CPU_DMA_LATENCY, or with latency_irq_cpu only
+ * the CPU that takes the board interrupt, through its resume latency.
+ */
+static void addi_serial_qos_apply(struct addi_port *ap)
+{
+	struct device *cpu_dev;
+	int cpu;
+
+	mutex_lock(&ap->qos_lock);
+	if (pm_qos_request_active(&ap->qos))
+		pm_qos_remove_request(&ap->qos);
+	if (ap->qos_cpu >= 0)
+	{
+		dev_pm_qos_remove_request(&ap->cpu_qos);
+		ap->qos_cpu = -1;
+	}
+
+	if (ap->qos_open && ap->latency_us >= 0)
+	{
+		if (!ap->latency_irq_cpu)
+		{
+			pm_qos_add_request(&ap->qos, PM_QOS_CPU_DMA_LATENCY,
+							   ap->latency_us);
+		}
+		else
+		{
+			cpu = READ_ONCE(ap->priv->irq_cpu);
+			cpu_dev = get_cpu_device(cpu);
+			if (cpu_dev &&
+				dev_pm_qos_add_request(cpu_dev, &ap->cpu_qos,
+									   DEV_PM_QOS_RESUME_LATENCY,
+									   ap->latency_us) >= 0)
+				ap->qos_cpu = cpu;
+		}
+	}
+	mutex_unlock(&ap->qos_lock);
+}
+
+static void addi_serial_qos_open(struct addi_port *ap, bool open)
+{
+	if (ap->qos_open == open)
+		return;
+
+	ap->qos_open = open;
+	if (ap->latency_us >= 0)
+		addi_serial_qos_apply(ap);
+}
+
+static int addi_serial_set_latency(struct addi_port *ap,
+								   struct addi_serial_latency __user *argp)
+{
+	struct addi_serial_latency req;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~ADDI_SERIAL_LATENCY_IRQ_CPU)
+		return -EINVAL;
+
+	ap->latency_us = req.latency_us < 0 ? -1 : req.latency_us;
+	ap->latency_irq_cpu = req.flags & ADDI_SERIAL_LATENCY_IRQ_CPU;
+	addi_serial_qos_apply(ap);
+	return 0;
+}
+
+/*
+ * Board IRQ placement.  Each board's IRQ is given one CPU of irq_cpus:
+ * at probe the one serving the fewest boards, later every
+ * irq_balance_ms by spreading the measured interrupt rates, busiest
+ * board first.  The affinity is applied while a port has the IRQ
+ * requested and the hint is dropped before the 8250 core frees it.
+ */
+static int addi_serial_irq_users(unsigned int irq)
+{
+	struct addi_port *ap;
+	int users = 0;
+
+	mutex_lock(&addi_serial_ports_lock);
+	list_for_each_entry(ap, &addi_serial_ports, node)
+		if (ap->irq_linked && ap->up->port.irq == irq)
+			users++;
+	mutex_unlock(&addi_serial_ports_lock);
+
+	return users;
+}
+
+/* Called with addi_serial_boards_lock held */
+static void addi_serial_irq_apply(struct serial_private *priv)
+{
+	if (priv->irq && addi_serial_irq_users(priv->irq))
+		irq_set_affinity_hint(priv->irq, cpumask_of(priv->irq_cpu));
+}
+
+/* After serial8250_do_startup() has requested the IRQ */
+static void addi_serial_irq_link(struct addi_port *ap)
+{
+	mutex_lock(&addi_serial_boards_lock);
+	ap->irq_linked = true;
+	addi_serial_irq_apply(ap->priv);
+	mutex_unlock(&addi_serial_boards_lock);
+}
+
+/* Before serial8250_do_shutdown() may free the IRQ */
+static void addi_serial_irq_unlink(struct addi_port *ap)
+{
+	unsigned int irq = ap->up->port.irq;
+
+	mutex_lock(&addi_serial_boards_lock);
+	ap->irq_linked = false;
+	if (irq && !addi_serial_irq_users(irq))
+		irq_set_affinity_hint(irq, NULL);
+	mutex_unlock(&addi_serial_boards_lock);
+}
+
+/* Least loaded CPU of the IRQ mask, @prefer on a tie */
+static int addi_serial_irq_least_loaded(const u64 *load, int prefer)
+{
+	int cpu, best = prefer;
+
+	if (best < 0 || !cpumask_test_cpu(best, &addi_irq_mask))
+		best = cpumask_first(&addi_irq_mask);
+
+	for_each_cpu(cpu, &addi_irq_mask)
+		if (load[cpu] < load[best])
+			best = cpu;
+
+	return best;
+}
+
+static void addi_serial_irq_place(struct serial_private *priv)
+{
+	struct serial_private *other;
+	bool shared = false;
+	u64 *load;
+
+	load = kcalloc(nr_cpu_ids, sizeof(*load), GFP_KERNEL);
+
+	mutex_lock(&addi_serial_boards_lock);
+	priv->irq_cpu = cpumask_first(&addi_irq_mask);
+	list_for_each_entry(other, &addi_serial_boards, node)
+	{
+		/* Boards sharing a line share its CPU */
+		if (other->irq == priv->irq)
+		{
+			priv->irq_cpu = other->irq_cpu;
+			shared = true;
+			break;
+		}
+		if (load)
+			load[other->irq_cpu]++;
+	}
+	if (!shared && load)
+		priv->irq_cpu = addi_serial_irq_least_loaded(load, -1);
+	list_add_tail(&priv->node, &addi_serial_boards);
+	mutex_unlock(&addi_serial_boards_lock);
+
+	kfree(load);
+}
+
+static void addi_serial_irq_forget(struct serial_private *priv)
+{
+	mutex_lock(&addi_serial_boards_lock);
+	list_del(&priv->node);
+	mutex_unlock(&addi_serial_boards_lock);
+}
+
+/* Move per-CPU QoS requests along with a board's IRQ */
+static void addi_serial_qos_follow(struct serial_private *priv)
+{
+	struct addi_port *ap;
+	int i;
+
+	for (i = 0; i < priv->nr; i++)
+	{
+		ap = priv->port[i];
+		if (ap && ap->latency_irq_cpu && READ_ONCE(ap->qos_cpu) >= 0)
+			addi_serial_qos_apply(ap);
+	}
+}
+
+static struct serial_private *addi_serial_irq_busiest(void)
+{
+	struct serial_private *priv, *busiest = NULL;
+
+	list_for_each_entry(priv, &addi_serial_boards, node)
+		if (priv->irq_new_cpu < 0 &&
+			(!busiest || priv->irq_rate > busiest->irq_rate))
+			busiest = priv;
+
+	return busiest;
+}
+
+static void addi_serial_balance_fn(struct work_struct *work)
+{
+	struct serial_private *priv, *other;
+	unsigned int ms = irq_balance_ms;
+	u64 *load, old_max = 0, new_max = 0;
+	int cpu;
+	u64 n;
+
+	load = kcalloc(nr_cpu_ids, sizeof(*load), GFP_KERNEL);
+	if (!load)
+		goto out;
+
+	mutex_lock(&addi_serial_boards_lock);
+	list_for_each_entry(priv, &addi_serial_boards, node)
+	{
+		n = atomic64_read(&priv->irqs);
+		priv->irq_rate = div64_u64((n - priv->irqs_last) * MSEC_PER_SEC, ms);
+		priv->irqs_last = n;
+		priv->irq_new_cpu = -1;
+		load[priv->irq_cpu] += priv->irq_rate;
+	}
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		old_max = max(old_max, load[cpu]);
+
+	/* Longest processing time first */
+	memset(load, 0, nr_cpu_ids * sizeof(*load));
+	while ((priv = addi_serial_irq_busiest()))
+	{
+		cpu = addi_serial_irq_least_loaded(load, priv->irq_cpu);
+		list_for_each_entry(other, &addi_serial_boards, node)
+		{
+			if (other->irq != priv->irq)
+				continue;
+			other->irq_new_cpu = cpu;
+			load[cpu] += other->irq_rate;
+		}
+	}
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		new_max = max(new_max, load[cpu]);
+
+	/* Only move interrupts for a clear gain on the busiest CPU */
+	if (new_max * 5 < old_max * 4)
+	{
+		list_for_each_entry(priv, &addi_serial_boards, node)
+		{
+			if (priv->irq_new_cpu == priv->irq_cpu)
+				continue;
+			priv->irq_cpu = priv->irq_new_cpu;
+			priv->irq_moves++;
+			addi_serial_irq_apply(priv);
+			addi_serial_qos_follow(priv);
+		}
+	}
+	mutex_unlock(&addi_serial_boards_lock);
+	kfree(load);
+out:
+	schedule_delayed_work(&addi_serial_balance_work, msecs_to_jiffies(ms));
+}
+
+static int addi_serial_startup(struct uart_port *port)
+{
+	struct uart_8250_port *up = up_to_u8250p(port);
+	struct addi_port *ap = port->private_data;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	int ret;
+
+	if (ap->state != ADDI_PORT_WARM)
+	{
+		ret = serial8250_do_startup(port);
+		if (!ret)
+		{
+			ap->state = ADDI_PORT_ACTIVE;
+			addi_serial_hist_add(ap->stats.open_cold, start);
+			addi_serial_irq_link(ap);
+			addi_serial_qos_open(ap, true);
+			/* The board handler skipped us until now */
+			if (READ_ONCE(ap->priv->irq_owned))
+				addi_serial_port_irq(port);
+		}
+		return ret;
+	}
+
+	/*
+	 * Warm port: FIFOs, LCR, divisor and MCR are still programmed and
+	 * the IRQ is still linked.  Drop what arrived while closed and
+	 * re-enable the interrupts we had.
+	 */
+	spin_lock_irqsave(&port->lock, flags);
+	serial_out(up, UART_FCR, up->fcr | UART_FCR_CLEAR_RCVR);
+	up->lsr_saved_flags = 0;
+	up->msr_saved_flags = 0;
+	serial_in(up, UART_LSR);
+	serial_in(up, UART_MSR);
+	up->ier = ap->warm_ier & ~UART_IER_THRI;
+	serial_out(up, UART_IER, up->ier);
+	ap->state = ADDI_PORT_ACTIVE;
+	ap->warm_restore = true;
+	addi_serial_hist_add(ap->stats.open_warm, start);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	addi_serial_qos_open(ap, true);
+	return 0;
+}
+
+static void addi_serial_shutdown(struct uart_port *port)
+{
+	struct uart_8250_port *up = up_to_u8250p(port);
+	struct addi_port *ap = port->private_data;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+
+	addi_serial_timed_flush(ap);
+	hrtimer_cancel(&ap->drain_timer);
+	addi_serial_qos_open(ap, false);
+
+	spin_lock_irqsave(&port->lock, flags);
+	ap->urgent.head = ap->urgent.tail = 0;
+	ap->ring.tail = ap->ring.head;
+	addi_serial_bcast_flush(ap);
+	ap->sync_armed = false;
+	ap->resp_len = 0;
+	if (ap->warm)
+	{
+		ap->warm_ier = up->ier;
+		up->ier = 0;
+		serial_out(up, UART_IER, 0);
+		serial_out(up, UART_LCR, up->lcr & ~UART_LCR_SBC);
+		ap->state = ADDI_PORT_WARM;
+		addi_serial_hist_add(ap->stats.close_warm, start);
+	}
+	else
+		ap->state = ADDI_PORT_CLOSING;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (ap->state == ADDI_PORT_WARM)
+	{
+		cancel_work_sync(&ap->rx_work);
+		return;
+	}
+
+	addi_serial_irq_unlink(ap);
+	serial8250_do_shutdown(port);
+	cancel_work_sync(&ap->rx_work);
+	ap->state = ADDI_PORT_COLD;
+	addi_serial_hist_add(ap->stats.close_cold, start);
+}
+
+/*
+ * Finish the shutdown of a warm port, e.g. before it is unregistered
+ * or suspended.
+ */
+static void addi_serial_cool(struct addi_port *ap)
+{
+	struct tty_port *tport = &ap->up->port.state->port;
+
+	mutex_lock(&tport->mutex);
+	if (ap->state == ADDI_PORT_WARM)
+	{
+		addi_serial_irq_unlink(ap);
+		serial8250_do_shutdown(&ap->up->port);
+		ap->state = ADDI_PORT_COLD;
+	}
+	mutex_unlock(&tport->mutex);
+}
+
+/*
+ * Speed-only change on a running port.  serial8250_do_set_termios()
+ * rewrites FCR and reprograms the divisor under whatever is still
+ * being shifted out; here TX refills are held until the transmitter is
+ * idle, then only LCR/DLL/DLM are written, so the RX FIFO survives and
+ * no byte straddles the rate change.  Returns false if the change is
+ * not speed-only and the core has to do it.
+ */
+static bool addi_serial_set_speed(struct addi_port *ap,
+								  struct ktermios *termios)
+{
+	struct uart_8250_port *up = ap->up;
+	struct uart_port *port = &up->port;
+	unsigned int baud, quot;
+	unsigned long flags;
+	ktime_t start, idle;
+	s64 timeout;
+
+	if (ap->state != ADDI_PORT_ACTIVE || !ap->char_ns)
+		return false;
+	if ((termios->c_cflag ^ ap->termios.c_cflag) & ~(CBAUD | CIBAUD))
+		return false;
+	if (termios->c_iflag != ap->termios.c_iflag ||
+		!tty_termios_baud_rate(termios))
+		return false;
+
+	baud = uart_get_baud_rate(port, termios, &ap->termios, 0,
+							  port->uartclk / 16);
+	quot = uart_get_divisor(port, baud);
+	if (!quot || quot > 0xffff)
+		return false;
+
+	start = ktime_get();
+
+	spin_lock_irqsave(&port->lock, flags);
+	ap->tx_hold = true;
+	addi_serial_stop_tx(up);
+	hrtimer_start(&ap->drain_timer,
+				  ktime_before(ap->drain_end, start) ? start : ap->drain_end,
+				  HRTIMER_MODE_ABS);
+	timeout = ktime_to_ns(ktime_sub(ap->drain_end, start));
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	/* At most a FIFO plus the shift register at the old rate */
+	timeout = max_t(s64, timeout, 0) +
+			  (port->fifosize + 2) * ap->char_ns + NSEC_PER_MSEC;
+	wait_event_hrtimeout(ap->drain_wq, ap->orig_ops->tx_empty(port),
+						 ns_to_ktime(timeout));
+	idle = ktime_get();
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (!(serial_in(up, UART_LSR) & UART_LSR_TEMT))
+		ap->stats.speed_tx_busy++;
+
+	serial_out(up, UART_LCR, up->lcr | UART_LCR_DLAB);
+	serial_dl_write(up, quot);
+	serial_out(up, UART_LCR, up->lcr);
+	uart_update_timeout(port, termios->c_cflag, baud);
+
+	ap->tx_hold = false;
+	ap->drain_end = ktime_get();
+	if (!uart_tx_stopped(port))
+		port->ops->start_tx(port);
+
+	ap->stats.speed_changes++;
+	ap->stats.speed_wait_ns = ktime_to_ns(ktime_sub(idle, start));
+	ap->stats.speed_switch_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (ap->stats.speed_switch_ns > ap->stats.speed_switch_max_ns)
+		ap->stats.speed_switch_max_ns = ap->stats.speed_switch_ns;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (tty_termios_baud_rate(termios))
+		tty_termios_encode_baud_rate(termios, baud, baud);
+	return true;
+}
+
+/* The 8250 core drops MSI with CLOCAL; PPS needs it regardless */
+static void addi_serial_pps_ms(struct addi_port *ap)
+{
+	struct uart_8250_port *up = ap->up;
+	unsigned long flags;
+
+	spin_lock_irqsave(&up->port.lock, flags);
+	if (ap->pps_delta && ap->state == ADDI_PORT_ACTIVE &&
+		!(up->ier & UART_IER_MSI))
+	{
+		up->ier |= UART_IER_MSI;
+		serial_out(up, UART_IER, up->ier);
+	}
+	spin_unlock_irqrestore(&up->port.lock, flags);
+}
+
+/* Make DCD or CTS (UART_MSR_DDCD/DCTS in @delta) a PPS source, 0 for none */
+static int addi_serial_pps_set(struct addi_port *ap, u8 delta)
+{
+	struct uart_port *port = &ap->up->port;
+	struct pps_source_info info = {
+		.name = "addi_serial",
+		.mode = PPS_CAPTUREBOTH | PPS_OFFSETASSERT | PPS_OFFSETCLEAR |
+				PPS_CANWAIT | PPS_TSFMT_TSPEC,
+		.owner = THIS_MODULE,
+		.dev = port->dev,
+	};
+	struct pps_device *pps = NULL, *old;
+	unsigned long flags;
+
+	if (delta && !ap->pps)
+	{
+		snprintf(info.path, sizeof(info.path), "ttyS%d", ap->line);
+		pps = pps_register_source(&info, PPS_CAPTUREBOTH |
+												PPS_OFFSETASSERT |
+												PPS_OFFSETCLEAR);
+		if (!pps)
+			return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&port->lock, flags);
+	old = delta ? NULL : ap->pps;
+	if (pps)
+		ap->pps = pps;
+	if (old)
+		ap->pps = NULL;
+	ap->pps_delta = delta;
+	ap->edge_last = 0;
+	ap->edge_period = 0;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (old)
+		pps_unregister_source(old);
+	addi_serial_pps_ms(ap);
+	return 0;
+}
+
+static void addi_serial_set_termios(struct uart_port *port,
+									struct ktermios *termios,
+									struct ktermios *old)
+{
+	struct addi_port *ap = port->private_data;
+
+	/*
+	 * The first set_termios after a warm open normally just repeats
+	 * the settings the UART still holds.
+	 */
+	if (ap->warm_restore)
+	{
+		ap->warm_restore = false;
+		if (termios->c_cflag == ap->termios.c_cflag &&
+			termios->c_iflag == ap->termios.c_iflag &&
+			termios->c_ispeed == ap->termios.c_ispeed &&
+			termios->c_ospeed == ap->termios.c_ospeed)
+			return;
+	}
+
+	if (!addi_serial_set_speed(ap, termios))
+		serial8250_do_set_termios(port, termios, old);
+	addi_serial_pps_ms(ap);
+
+	ap->termios = *termios;
+	addi_serial_update_char_ns(ap, termios);
+}
+
+/*
+ * Fan one write out to every open port of @ap's group.  The data is
+ * copied from userspace once; each member queues a reference.  With
+ * ADDI_SERIAL_GROUP_SYNC refills are held on all members until the
+ * data is queued everywhere, then each member's FIFO is loaded in one
+ * tight pass.
+ */
+static int addi_serial_group_write(struct addi_port *ap,
+								   struct addi_serial_group_write __user *argp)
+{
+	struct addi_port **members = NULL;
+	struct addi_serial_group_write req;
+	struct addi_bcast_buf *buf;
+	struct addi_port *m;
+	struct uart_port *port;
+	unsigned long flags;
+	int i, n, nr = 0, ret;
+	bool sync;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (!req.len || req.len > ADDI_SERIAL_GROUP_MAX_LEN ||
+		req.flags & ~ADDI_SERIAL_GROUP_SYNC)
+		return -EINVAL;
+	if (!ap->group)
+		return -ENOENT;
+	sync = req.flags & ADDI_SERIAL_GROUP_SYNC;
+
+	/* kmalloc, not kvmalloc: the last reference goes in the refill */
+	buf = kmalloc(sizeof(*buf) + req.len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	kref_init(&buf->ref);
+	buf->len = req.len;
+	if (copy_from_user(buf->data, u64_to_user_ptr(req.data), req.len))
+	{
+		kfree(buf);
+		return -EFAULT;
+	}
+
+	/* The port list lock also serialises group writes */
+	mutex_lock(&addi_serial_ports_lock);
+	list_for_each_entry(m, &addi_serial_ports, node)
+	{
+		if (m->group != ap->group || m->state != ADDI_PORT_ACTIVE)
+			continue;
+		if (m->bcast_head - m->bcast_tail >= ADDI_SERIAL_BCAST_QUEUE)
+		{
+			ret = -EAGAIN;
+			goto out;
+		}
+		nr++;
+	}
+
+	/* Any number of boards may probe, so no fixed bound on a group */
+	members = kmalloc_array(nr, sizeof(*members), GFP_KERNEL);
+	if (!members)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+	i = 0;
+	list_for_each_entry(m, &addi_serial_ports, node)
+		if (m->group == ap->group && m->state == ADDI_PORT_ACTIVE && i < nr)
+			members[i++] = m;
+	nr = i;
+
+	/*
+	 * A member may have closed since the scan; its shutdown flushed
+	 * the queue, so anything added now would leak a reference and go
+	 * out on the next open.  Only members still active are kept.
+	 */
+	for (i = 0, n = 0; i < nr; i++)
+	{
+		m = members[i];
+		port = &m->up->port;
+		spin_lock_irqsave(&port->lock, flags);
+		if (m->state != ADDI_PORT_ACTIVE)
+		{
+			spin_unlock_irqrestore(&port->lock, flags);
+			continue;
+		}
+		members[n++] = m;
+		kref_get(&buf->ref);
+		m->bcast[m->bcast_head % ADDI_SERIAL_BCAST_QUEUE].buf = buf;
+		m->bcast[m->bcast_head % ADDI_SERIAL_BCAST_QUEUE].pos = 0;
+		m->bcast_head++;
+		m->bcast_hold |= sync;
+		m->stats.group_writes++;
+		m->stats.group_bytes += req.len;
+		if (!sync && !uart_tx_stopped(port))
+			port->ops->start_tx(port);
+		spin_unlock_irqrestore(&port->lock, flags);
+	}
+	nr = n;
+
+	if (sync)
+	{
+		local_irq_save(flags);
+		for (i = 0; i < nr; i++)
+		{
+			m = members[i];
+			port = &m->up->port;
+			spin_lock(&port->lock);
+			m->bcast_hold = false;
+			if (!uart_tx_stopped(port))
+			{
+				if (serial_port_in(port, UART_LSR) & UART_LSR_THRE)
+					addi_serial_tx_chars(m->up);
+				port->ops->start_tx(port);
+			}
+			spin_unlock(&port->lock);
+		}
+		local_irq_restore(flags);
+	}
+	ret = nr;
+out:
+	mutex_unlock(&addi_serial_ports_lock);
+	kfree(members);
+	kref_put(&buf->ref, addi_bcast_release);
+	return ret;
+}
+
+/*
+ * One step of a modem control sequence.  Steps are scheduled from the
+ * start time, not from each other, so late timer expiries do not add
+ * up; with timed_lead_us the timer fires early and spins to the slot.
+ */
+static enum hrtimer_restart addi_serial_mcr_fire(struct hrtimer *timer)
+{
+	struct addi_port *ap = container_of(timer, struct addi_port, mcr_timer);
+	struct uart_port *port = &ap->up->port;
+	struct addi_mcr_seq *seq = ap->mcr_seq;
+	u64 lead = min(timed_lead_us, 100U) * NSEC_PER_USEC;
+	struct addi_serial_mcr_step *step;
+	unsigned long flags;
+	bool more;
+
+	spin_lock_irqsave(&port->lock, flags);
+	while (ktime_before(ktime_get(), seq->next))
+		cpu_relax();
+
+	step = &seq->steps[seq->pos];
+	port->mctrl = (port->mctrl & ~ADDI_SERIAL_MCR_BITS) | step->mctrl;
+	port->ops->set_mctrl(port, port->mctrl);
+	seq->actual[seq->pos] = ktime_to_ns(ktime_sub(ktime_get(), seq->start));
+	seq->next = ktime_add_ns(seq->next, step->delay_ns);
+	more = ++seq->pos < seq->count;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (more)
+		hrtimer_start(timer, ktime_sub_ns(seq->next, lead), HRTIMER_MODE_ABS);
+	else
+		complete(&seq->done);
+
+	return HRTIMER_NORESTART;
+}
+
+static int addi_serial_mcr_sequence(struct addi_port *ap,
+									struct addi_serial_mcr_seq __user *argp)
+{
+	struct uart_port *port = &ap->up->port;
+	struct addi_serial_mcr_seq req;
+	struct addi_mcr_seq *seq;
+	unsigned long flags;
+	u64 total = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (!req.count || req.count > ADDI_SERIAL_MCR_STEPS || req.flags)
+		return -EINVAL;
+
+	seq = kzalloc(sizeof(*seq), GFP_KERNEL);
+	if (!seq)
+		return -ENOMEM;
+	if (copy_from_user(seq->steps, u64_to_user_ptr(req.steps),
+					   req.count * sizeof(seq->steps[0])))
+	{
+		ret = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < req.count; i++)
+	{
+		if (seq->steps[i].mctrl & ~ADDI_SERIAL_MCR_BITS)
+		{
+			ret = -EINVAL;
+			goto out;
+		}
+		/* The last step's delay is never waited for */
+		if (i + 1 < req.count)
+			total += seq->steps[i].delay_ns;
+	}
+	/* The length limit is explained at addi_serial_ioctl() */
+	if (total > ADDI_SERIAL_MCR_MAX_NS)
+	{
+		ret = -EINVAL;
+		goto out;
+	}
+	seq->count = req.count;
+	init_completion(&seq->done);
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->mcr_seq)
+		ret = -EBUSY;
+	else
+		ap->mcr_seq = seq;
+	spin_unlock_irqrestore(&port->lock, flags);
+	if (ret)
+		goto out;
+
+	seq->start = seq->next = ktime_get();
+	hrtimer_start(&ap->mcr_timer, seq->next, HRTIMER_MODE_ABS);
+	if (wait_for_completion_interruptible(&seq->done))
+	{
+		hrtimer_cancel(&ap->mcr_timer);
+		ret = -EINTR;
+	}
+
+	spin_lock_irqsave(&port->lock, flags);
+	ap->mcr_seq = NULL;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (copy_to_user(u64_to_user_ptr(req.actual), seq->actual,
+					 seq->pos * sizeof(seq->actual[0])))
+		ret = -EFAULT;
+	if (!ret)
+		ret = seq->pos;
+out:
+	kfree(seq);
+	return ret;
+}
+
+static bool addi_serial_resp_valid(const struct addi_serial_response *e)
+{
+	unsigned int i;
+
+	if (!e->match_len || e->match_len > ADDI_SERIAL_RESP_MATCH_LEN ||
+		e->reply_len > ADDI_SERIAL_RESP_REPLY_LEN ||
+		e->ncopy > ADDI_SERIAL_RESP_COPIES ||
+		e->flags & ~ADDI_SERIAL_RESP_MODBUS_CRC)
+		return false;
+
+	for (i = 0; i < e->ncopy; i++)
+		if (e->copy[i].from + e->copy[i].len > e->match_len ||
+			e->copy[i].to + e->copy[i].len > e->reply_len)
+			return false;
+
+	return true;
+}
+
+/* Load or remove the auto-responder table, see addi_serial_resp_rx() */
+static int addi_serial_set_responder(struct addi_port *ap,
+									 struct addi_serial_responder __user *argp)
+{
+	struct uart_port *port = &ap->up->port;
+	struct addi_responder *resp = NULL, *old;
+	struct addi_serial_responder req;
+	unsigned long flags;
+	unsigned int i;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.count > ADDI_SERIAL_RESP_ENTRIES || req.flags)
+		return -EINVAL;
+
+	if (req.count)
+	{
+		resp = kmalloc(sizeof(*resp) + req.count * sizeof(resp->e[0]),
+					   GFP_KERNEL);
+		if (!resp)
+			return -ENOMEM;
+		resp->count = req.count;
+		if (copy_from_user(resp->e, u64_to_user_ptr(req.entries),
+						   req.count * sizeof(resp->e[0])))
+		{
+			kfree(resp);
+			return -EFAULT;
+		}
+		for (i = 0; i < req.count; i++)
+		{
+			if (!addi_serial_resp_valid(&resp->e[i]))
+			{
+				kfree(resp);
+				return -EINVAL;
+			}
+		}
+	}
+
+	spin_lock_irqsave(&port->lock, flags);
+	old = ap->resp;
+	ap->resp = resp;
+	ap->resp_len = 0;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	kfree(old);
+	return 0;
+}
+
+static int addi_serial_sync_arm(struct addi_port *ap, int arm)
+{
+	struct uart_port *port = &ap->up->port;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	ap->sync_armed = arm;
+	if (!arm && !uart_tx_stopped(port))
+		port->ops->start_tx(port);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return 0;
+}
+
+/* 16C950 indexed control register write, as serial_icr_write() */
+static void addi_serial_icr_write(struct uart_8250_port *up, int offset,
+								  int value)
+{
+	serial_out(up, UART_SCR, offset);
+	serial_out(up, UART_ICR, value);
+}
+
+/*
+ * Start the armed ports in @req->ports together.  All their port locks
+ * are taken, nested by port index, with interrupts off.  On 16C950s the
+ * transmitters are disabled through ACR, the FIFOs loaded and the
+ * transmitters enabled again one after the other, so the skew is a few
+ * register writes.  Other UARTs cannot hold a loaded FIFO, so the FIFOs
+ * are loaded back to back and the skew is one FIFO load per port.
+ */
+static int addi_serial_sync_start(struct addi_port *ap,
+								  struct addi_serial_sync_start __user *argp)
+{
+	struct serial_private *priv = ap->priv;
+	struct addi_serial_sync_start req;
+	struct addi_port *m;
+	unsigned long flags;
+	bool txdis = true;
+	u64 start, end;
+	int i, ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (!req.ports || req.flags ||
+		req.ports & ~GENMASK(ADDI_SERIAL_MAX_PORTS - 1, 0))
+		return -EINVAL;
+
+	mutex_lock(&addi_serial_ports_lock);
+	for (i = 0; i < ADDI_SERIAL_MAX_PORTS; i++)
+	{
+		if (!(req.ports & BIT(i)))
+			continue;
+		m = priv->port[i];
+		if (!m || m->state != ADDI_PORT_ACTIVE || !m->sync_armed)
+		{
+			ret = -EINVAL;
+			goto out;
+		}
+		if (m->up->port.type != PORT_16C950)
+			txdis = false;
+	}
+
+	local_irq_save(flags);
+	for (i = 0; i < ADDI_SERIAL_MAX_PORTS; i++)
+		if (req.ports & BIT(i))
+			spin_lock_nested(&priv->port[i]->up->port.lock, i);
+
+	/*
+	 * The checks above ran without the port locks; a port may have
+	 * closed or been disarmed since.  Earlier data still in a FIFO
+	 * would start that port early.
+	 */
+	for (i = 0; i < ADDI_SERIAL_MAX_PORTS; i++)
+	{
+		if (!(req.ports & BIT(i)))
+			continue;
+		m = priv->port[i];
+		if (m->state != ADDI_PORT_ACTIVE || !m->sync_armed)
+		{
+			ret = -EINVAL;
+			goto unlock;
+		}
+		if (!(serial_in(m->up, UART_LSR) & UART_LSR_THRE))
+			ret = -EBUSY;
+	}
+	if (ret)
+		goto unlock;
+
+	if (txdis)
+	{
+		for (i = 0; i < ADDI_SERIAL_MAX_PORTS; i++)
+		{
+			if (!(req.ports & BIT(i)))
+				continue;
+			m = priv->port[i];
+			m->up->acr |= UART_ACR_TXDIS;
+			addi_serial_icr_write(m->up, UART_ACR, m->up->acr);
+			m->sync_armed = false;
+			addi_serial_tx_chars(m->up);
+		}
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < ADDI_SERIAL_MAX_PORTS; i++)
+	{
+		if (!(req.ports & BIT(i)))
+			continue;
+		m = priv->port[i];
+		if (txdis)
+		{
+			m->up->acr &= ~UART_ACR_TXDIS;
+			addi_serial_icr_write(m->up, UART_ACR, m->up->acr);
+		}
+		else
+		{
+			m->sync_armed = false;
+			addi_serial_tx_chars(m->up);
+		}
+	}
+	end = ktime_get_ns();
+
+unlock:
+	for (i = ADDI_SERIAL_MAX_PORTS - 1; i >= 0; i--)
+	{
+		if (!(req.ports & BIT(i)))
+			continue;
+		m = priv->port[i];
+		/* Anything that did not fit in the FIFO goes out by interrupt */
+		if (!ret && !uart_tx_stopped(&m->up->port))
+			m->up->port.ops->start_tx(&m->up->port);
+		spin_unlock(&m->up->port.lock);
+	}
+	local_irq_restore(flags);
+	if (ret)
+		goto out;
+
+	req.skew_ns = min_t(u64, end - start, U32_MAX);
+	req.method = txdis ? ADDI_SERIAL_SYNC_TXDIS : ADDI_SERIAL_SYNC_FIFO_LOAD;
+	ap->stats.sync_starts++;
+	ap->stats.sync_skew_ns = req.skew_ns;
+	ap->stats.sync_skew_max_ns = max_t(u64, ap->stats.sync_skew_max_ns,
+									   req.skew_ns);
+	if (copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+out:
+	mutex_unlock(&addi_serial_ports_lock);
+	return ret;
+}
+
+/*
+ * Bridge @ap to the port on tty line @line, or remove its bridge if
+ * line < 0.  With @bidir the peer is bridged back (or unbridged) too.
+ * This redirects another line's data, so it is for the administrator.
+ */
+static int addi_serial_set_bridge(struct addi_port *ap, int line,
+								  bool monitor, bool bidir)
+{
+	struct addi_port *to = NULL, *old, *other;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	mutex_lock(&addi_serial_ports_lock);
+	if (line >= 0)
+	{
+		list_for_each_entry(other, &addi_serial_ports, node)
+			if (other->line == line)
+				to = other;
+		if (!to || to == ap)
+		{
+			mutex_unlock(&addi_serial_ports_lock);
+			return to ? -EINVAL : -ENODEV;
+		}
+	}
+
+	old = rcu_dereference_protected(ap->bridge,
+									lockdep_is_held(&addi_serial_ports_lock));
+	WRITE_ONCE(ap->bridge_monitor, monitor);
+	rcu_assign_pointer(ap->bridge, to);
+	if (bidir && to)
+	{
+		WRITE_ONCE(to->bridge_monitor, monitor);
+		rcu_assign_pointer(to->bridge, ap);
+	}
+	else if (bidir && old && rcu_access_pointer(old->bridge) == ap)
+		RCU_INIT_POINTER(old->bridge, NULL);
+	mutex_unlock(&addi_serial_ports_lock);
+
+	return 0;
+}
+
+static int addi_serial_bridge_ioctl(struct addi_port *ap,
+									struct addi_serial_bridge __user *argp)
+{
+	struct addi_serial_bridge req;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~(ADDI_SERIAL_BRIDGE_BIDIR | ADDI_SERIAL_BRIDGE_MONITOR))
+		return -EINVAL;
+
+	return addi_serial_set_bridge(ap, req.line,
+								  req.flags & ADDI_SERIAL_BRIDGE_MONITOR,
+								  req.flags & ADDI_SERIAL_BRIDGE_BIDIR);
+}
+
+/*
+ * uart_ioctl() calls us with the port mutex held.  MCR_SEQUENCE and
+ * AUTOBAUD wait for the line with it held, and open, close, termios
+ * changes and the other ioctls on the port wait behind them; so their
+ * waits are capped, by ADDI_SERIAL_MCR_MAX_NS and
+ * ADDI_SERIAL_AUTOBAUD_MAX_MS, and longer jobs take several calls.
+ */
+static int addi_serial_ioctl(struct uart_port *port, unsigned int cmd,
+							 unsigned long arg)
+{
+	struct addi_port *ap = port->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd)
+	{
+	case ADDI_SERIAL_IOC_URGENT_WRITE:
+		return addi_serial_urgent_write(ap, argp);
+	case ADDI_SERIAL_IOC_TIMED_WRITE:
+		return addi_serial_timed_write(ap, argp);
+	case ADDI_SERIAL_IOC_TIMED_REPORT:
+		return addi_serial_timed_report(ap, argp);
+	case ADDI_SERIAL_IOC_SET_LATENCY:
+		return addi_serial_set_latency(ap, argp);
+	case ADDI_SERIAL_IOC_BRIDGE:
+		return addi_serial_bridge_ioctl(ap, argp);
+	case ADDI_SERIAL_IOC_GROUP_WRITE:
+		return addi_serial_group_write(ap, argp);
+	case ADDI_SERIAL_IOC_SYNC_ARM:
+		return addi_serial_sync_arm(ap, arg);
+	case ADDI_SERIAL_IOC_SYNC_START:
+		return addi_serial_sync_start(ap, argp);
+	case ADDI_SERIAL_IOC_RESPONDER:
+		return addi_serial_set_responder(ap, argp);
+	case ADDI_SERIAL_IOC_MCR_SEQUENCE:
+		return addi_serial_mcr_sequence(ap, argp);
+	case ADDI_SERIAL_IOC_AUTOBAUD:
+		return addi_serial_autobaud(ap, argp);
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+/*
+ * Replace the TX ring of a port that is not in use.
+ */
+static int addi_serial_resize_ring(struct addi_port *ap, u32 size)
+{
+	struct uart_port *port = &ap->up->port;
+	unsigned char *buf, *old;
+	unsigned long flags;
+	int ret = 0;
+
+	buf = kvmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&port->state->port.mutex);
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->state != ADDI_PORT_COLD)
+	{
+		old = buf;
+		ret = -EBUSY;
+	}
+	else
+	{
+		old = ap->ring.buf;
+		ap->ring.buf = buf;
+		ap->ring.size = size;
+		ap->ring.head = ap->ring.tail = 0;
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+	mutex_unlock(&port->state->port.mutex);
+
+	kvfree(old);
+	return ret;
+}
+
+/*
+ * Take over a port the 8250 core has just registered for us.
+ */
+static int addi_serial_attach_port(struct addi_port *ap, int line)
+{
+	struct uart_8250_port *up = serial8250_get_port(line);
+
+	ap->up = up;
+	spin_lock_init(&ap->tx_prod_lock);
+	mutex_init(&ap->qos_lock);
+	ap->latency_us = -1;
+	ap->qos_cpu = -1;
+	ap->rx_cpu = ADDI_SERIAL_RX_CPU_OFF;
+	ap->reader_cpu = -1;
+	ap->ring.size = ADDI_SERIAL_TX_RING_MIN;
+	ap->ring.buf = kvmalloc(ap->ring.size, GFP_KERNEL);
+	if (!ap->ring.buf)
+		return -ENOMEM;
+
+	ap->urgent.buf = (char *)ap->urgent_buf;
+	INIT_LIST_HEAD(&ap->timed_queue);
+	INIT_LIST_HEAD(&ap->timed_active);
+	hrtimer_init(&ap->timed_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ap->timed_timer.function = addi_serial_timed_fire;
+	hrtimer_init(&ap->mcr_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ap->mcr_timer.function = addi_serial_mcr_fire;
+	init_completion(&ap->ab_done);
+	INIT_WORK(&ap->ab_work, addi_serial_autobaud_apply);
+	INIT_WORK(&ap->rx_work, addi_serial_rx_work);
+	hrtimer_init(&ap->drain_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ap->drain_timer.function = addi_serial_drain_fire;
+	init_waitqueue_head(&ap->drain_wq);
+
+	ap->orig_ops = up->port.ops;
+	ap->ops = *up->port.ops;
+	ap->ops.tx_empty = addi_serial_tx_empty;
+	ap->ops.start_tx = addi_serial_start_tx;
+	ap->ops.flush_buffer = addi_serial_flush_buffer;
+	ap->ops.ioctl = addi_serial_ioctl;
+	up->port.ops = &ap->ops;
+
+	mutex_lock(&addi_serial_ports_lock);
+	list_add_tail(&ap->node, &addi_serial_ports);
+	mutex_unlock(&addi_serial_ports_lock);
+	return 0;
+}
+
+static void addi_serial_detach_port(struct addi_port *ap)
+{
+	struct addi_port *other;
+
+	cancel_work_sync(&ap->ab_work);
+
+	mutex_lock(&addi_serial_ports_lock);
+	addi_serial_pps_set(ap, 0);
+	list_del(&ap->node);
+	if (ap->capture)
+	{
+		ap->capture = false;
+		static_branch_dec(&addi_capture_on);
+	}
+	list_for_each_entry(other, &addi_serial_ports, node)
+		if (rcu_access_pointer(other->bridge) == ap)
+			RCU_INIT_POINTER(other->bridge, NULL);
+	RCU_INIT_POINTER(ap->bridge, NULL);
+	mutex_unlock(&addi_serial_ports_lock);
+
+	/* Interrupt handlers may still be forwarding to us */
+	synchronize_rcu();
+}
+
+/*
+ * Give a line back to the 8250 core.  Our ops go first, since
+ * unregistering re-adds the port when there are ISA devices.  The core
+ * keeps any hook a later registration does not supply, so ours are
+ * cleared and its defaults put back once the port is gone.
+ */
+static void addi_serial_release_line(struct addi_port *ap, int line)
+{
+	struct uart_8250_port *up = serial8250_get_port(line);
+
+	if (ap->orig_ops)
+		up->port.ops = ap->orig_ops;
+	serial8250_unregister_port(line);
+
+	up->port.startup = NULL;
+	up->port.shutdown = NULL;
+	up->port.set_termios = NULL;
+	up->port.private_data = NULL;
+	serial8250_set_defaults(up);
+}
+
+/*
+ * Work out the first tty line of a board from its PCI location, or -1
+ * if the board is not pinned and should take whatever line is free.
+ * slot_map entry n gets block n; physical slot s gets the block s past
+ * the slot_map ones, so the two never share lines.
+ */
+static int addi_serial_line_base(struct pci_dev *dev)
+{
+	unsigned int domain, bus, slot;
+	int i, block = -1;
+
+	for (i = 0; i < nr_slot_map; i++)
+	{
+		if (sscanf(slot_map[i], "%x:%x:%x", &domain, &bus, &slot) != 3)
+		{
+			domain = 0;
+			if (sscanf(slot_map[i], "%x:%x", &bus, &slot) != 2)
+				continue;
+		}
+
+		if (domain == pci_domain_nr(dev->bus) &&
+			bus == dev->bus->number &&
+			slot == PCI_SLOT(dev->devfn))
+		{
+			block = i;
+			break;
+		}
+	}
+
+	if (block < 0 && phys_slot && dev->slot)
+		block = nr_slot_map + dev->slot->number;
+	if (block < 0)
+		return -1;
+
+	if (first_line + (block + 1) * ADDI_SERIAL_MAX_PORTS >
+		CONFIG_SERIAL_8250_NR_UARTS)
+	{
+		dev_warn(&dev->dev, "line block %d is past the %d 8250 lines, not pinned\n",
+				 block, CONFIG_SERIAL_8250_NR_UARTS);
+		return -1;
+	}
+	return first_line + block * ADDI_SERIAL_MAX_PORTS;
+}
+
+#define to_addi_port(k) container_of(k, struct addi_port, kobj)
+
+static ssize_t index_show(struct kobject *kobj, struct kobj_attribute *attr,
+						  char *buf)
+{
+	return sprintf(buf, "%u\n", to_addi_port(kobj)->idx);
+}
+
+static ssize_t line_show(struct kobject *kobj, struct kobj_attribute *attr,
+						 char *buf)
+{
+	return sprintf(buf, "%d\n", to_addi_port(kobj)->line);
+}
+
+static ssize_t tty_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	return sprintf(buf, "ttyS%d\n", to_addi_port(kobj)->line);
+}
+
+static ssize_t warm_show(struct kobject *kobj, struct kobj_attribute *attr,
+						 char *buf)
+{
+	return sprintf(buf, "%d\n", to_addi_port(kobj)->warm);
+}
+
+static ssize_t warm_store(struct kobject *kobj, struct kobj_attribute *attr,
+						  const char *buf, size_t count)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+	bool warm;
+
+	if (kstrtobool(buf, &warm))
+		return -EINVAL;
+
+	ap->warm = warm;
+	if (!warm)
+		addi_serial_cool(ap);
+	return count;
+}
+
+static ssize_t tx_ring_size_show(struct kobject *kobj,
+								 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_addi_port(kobj)->ring.size);
+}
+
+static ssize_t tx_ring_size_store(struct kobject *kobj,
+								  struct kobj_attribute *attr,
+								  const char *buf, size_t count)
+{
+	unsigned int size;
+	int ret;
+
+	if (kstrtouint(buf, 0, &size))
+		return -EINVAL;
+	if (size < ADDI_SERIAL_TX_RING_MIN || size > ADDI_SERIAL_TX_RING_MAX)
+		return -ERANGE;
+
+	ret = addi_serial_resize_ring(to_addi_port(kobj),
+								  roundup_pow_of_two(size));
+	return ret ? ret : count;
+}
+
+static ssize_t tx_wake_pct_show(struct kobject *kobj,
+								struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_addi_port(kobj)->tx_wake_pct);
+}
+
+static ssize_t tx_wake_pct_store(struct kobject *kobj,
+								 struct kobj_attribute *attr,
+								 const char *buf, size_t count)
+{
+	unsigned int pct;
+
+	if (kstrtouint(buf, 0, &pct))
+		return -EINVAL;
+	if (pct > 100)
+		return -ERANGE;
+
+	WRITE_ONCE(to_addi_port(kobj)->tx_wake_pct, pct);
+	return count;
+}
+
+static ssize_t rx_cpu_show(struct kobject *kobj, struct kobj_attribute *attr,
+						   char *buf)
+{
+	int cpu = READ_ONCE(to_addi_port(kobj)->rx_cpu);
+
+	if (cpu == ADDI_SERIAL_RX_CPU_OFF)
+		return sprintf(buf, "off\n");
+	if (cpu == ADDI_SERIAL_RX_CPU_AUTO)
+		return sprintf(buf, "auto\n");
+	return sprintf(buf, "%d\n", cpu);
+}
+
+static ssize_t rx_cpu_store(struct kobject *kobj, struct kobj_attribute *attr,
+							const char *buf, size_t count)
+{
+	int cpu;
+
+	if (sysfs_streq(buf, "off"))
+		cpu = ADDI_SERIAL_RX_CPU_OFF;
+	else if (sysfs_streq(buf, "auto"))
+		cpu = ADDI_SERIAL_RX_CPU_AUTO;
+	else if (kstrtoint(buf, 0, &cpu))
+		return -EINVAL;
+	else if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return -ERANGE;
+
+	WRITE_ONCE(to_addi_port(kobj)->rx_cpu, cpu);
+	return count;
+}
+
+static ssize_t irq_prio_show(struct kobject *kobj, struct kobj_attribute *attr,
+							 char *buf)
+{
+	return sprintf(buf, "%u\n", to_addi_port(kobj)->irq_prio);
+}
+
+static ssize_t irq_prio_store(struct kobject *kobj, struct kobj_attribute *attr,
+							  const char *buf, size_t count)
+{
+	unsigned int prio;
+
+	if (kstrtouint(buf, 0, &prio))
+		return -EINVAL;
+	if (prio >= ADDI_SERIAL_IRQ_PRIOS)
+		return -ERANGE;
+
+	WRITE_ONCE(to_addi_port(kobj)->irq_prio, prio);
+	return count;
+}
+
+static ssize_t irq_budget_show(struct kobject *kobj,
+							   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_addi_port(kobj)->irq_budget);
+}
+
+static ssize_t irq_budget_store(struct kobject *kobj,
+								struct kobj_attribute *attr,
+								const char *buf, size_t count)
+{
+	unsigned int budget;
+
+	if (kstrtouint(buf, 0, &budget))
+		return -EINVAL;
+
+	WRITE_ONCE(to_addi_port(kobj)->irq_budget, budget);
+	return count;
+}
+
+static ssize_t latency_us_show(struct kobject *kobj,
+							   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", to_addi_port(kobj)->latency_us);
+}
+
+static ssize_t latency_us_store(struct kobject *kobj,
+								struct kobj_attribute *attr,
+								const char *buf, size_t count)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+	int us;
+
+	if (kstrtoint(buf, 0, &us))
+		return -EINVAL;
+
+	ap->latency_us = us < 0 ? -1 : us;
+	addi_serial_qos_apply(ap);
+	return count;
+}
+
+static ssize_t latency_scope_show(struct kobject *kobj,
+								  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n",
+				   to_addi_port(kobj)->latency_irq_cpu ? "irq" : "global");
+}
+
+static ssize_t latency_scope_store(struct kobject *kobj,
+								   struct kobj_attribute *attr,
+								   const char *buf, size_t count)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+
+	if (sysfs_streq(buf, "irq"))
+		ap->latency_irq_cpu = true;
+	else if (sysfs_streq(buf, "global"))
+		ap->latency_irq_cpu = false;
+	else
+		return -EINVAL;
+
+	addi_serial_qos_apply(ap);
+	return count;
+}
+
+static ssize_t bridge_show(struct kobject *kobj, struct kobj_attribute *attr,
+						   char *buf)
+{
+	struct addi_port *to;
+	int line;
+
+	rcu_read_lock();
+	to = rcu_dereference(to_addi_port(kobj)->bridge);
+	line = to ? to->line : -1;
+	rcu_read_unlock();
+
+	return sprintf(buf, "%d\n", line);
+}
+
+static ssize_t bridge_store(struct kobject *kobj, struct kobj_attribute *attr,
+							const char *buf, size_t count)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+	int line, ret;
+
+	if (kstrtoint(buf, 0, &line))
+		return -EINVAL;
+
+	ret = addi_serial_set_bridge(ap, line, ap->bridge_monitor, false);
+	return ret ? ret : count;
+}
+
+static ssize_t bridge_monitor_show(struct kobject *kobj,
+								   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", to_addi_port(kobj)->bridge_monitor);
+}
+
+static ssize_t bridge_monitor_store(struct kobject *kobj,
+									struct kobj_attribute *attr,
+									const char *buf, size_t count)
+{
+	bool monitor;
+
+	if (kstrtobool(buf, &monitor))
+		return -EINVAL;
+
+	WRITE_ONCE(to_addi_port(kobj)->bridge_monitor, monitor);
+	return count;
+}
+
+static ssize_t group_show(struct kobject *kobj, struct kobj_attribute *attr,
+						  char *buf)
+{
+	return sprintf(buf, "%u\n", to_addi_port(kobj)->group);
+}
+
+static ssize_t group_store(struct kobject *kobj, struct kobj_attribute *attr,
+						   const char *buf, size_t count)
+{
+	unsigned int group;
+
+	if (kstrtouint(buf, 0, &group))
+		return -EINVAL;
+
+	mutex_lock(&addi_serial_ports_lock);
+	to_addi_port(kobj)->group = group;
+	mutex_unlock(&addi_serial_ports_lock);
+	return count;
+}
+
+static ssize_t capture_show(struct kobject *kobj, struct kobj_attribute *attr,
+							char *buf)
+{
+	return sprintf(buf, "%d\n", to_addi_port(kobj)->capture);
+}
+
+static int addi_capture_alloc(struct serial_private *priv)
+{
+	struct addi_capture *cap;
+
+	if (priv->cap)
+		return 0;
+
+	cap = kzalloc(sizeof(*cap), GFP_KERNEL);
+	if (!cap)
+		return -ENOMEM;
+	cap->size = roundup_pow_of_two(max_t(unsigned int, capture_size,
+										 PAGE_SIZE));
+	cap->buf = kvmalloc(cap->size, GFP_KERNEL);
+	if (!cap->buf)
+	{
+		kfree(cap);
+		return -ENOMEM;
+	}
+	spin_lock_init(&cap->lock);
+	priv->cap = cap;
+	return 0;
+}
+
+static void addi_capture_free(struct serial_private *priv)
+{
+	if (!priv->cap)
+		return;
+	kvfree(priv->cap->buf);
+	kfree(priv->cap);
+	priv->cap = NULL;
+}
+
+static ssize_t capture_store(struct kobject *kobj, struct kobj_attribute *attr,
+							 const char *buf, size_t count)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+	struct uart_port *port = &ap->up->port;
+	unsigned long flags;
+	int ret = 0;
+	bool on;
+
+	if (kstrtobool(buf, &on))
+		return -EINVAL;
+
+	mutex_lock(&addi_serial_ports_lock);
+	if (on == ap->capture)
+		goto out;
+	if (on)
+	{
+		ret = addi_capture_alloc(ap->priv);
+		if (ret)
+			goto out;
+		static_branch_inc(&addi_capture_on);
+	}
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (!on)
+		addi_capture_flush(ap);
+	ap->capture = on;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (!on)
+		static_branch_dec(&addi_capture_on);
+out:
+	mutex_unlock(&addi_serial_ports_lock);
+	return ret ?: count;
+}
+
+static ssize_t pps_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	switch (to_addi_port(kobj)->pps_delta)
+	{
+	case UART_MSR_DDCD:
+		return sprintf(buf, "dcd\n");
+	case UART_MSR_DCTS:
+		return sprintf(buf, "cts\n");
+	}
+	return sprintf(buf, "off\n");
+}
+
+static ssize_t pps_store(struct kobject *kobj, struct kobj_attribute *attr,
+						 const char *buf, size_t count)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+	u8 delta;
+	int ret;
+
+	if (sysfs_streq(buf, "dcd"))
+		delta = UART_MSR_DDCD;
+	else if (sysfs_streq(buf, "cts"))
+		delta = UART_MSR_DCTS;
+	else if (sysfs_streq(buf, "off"))
+		delta = 0;
+	else
+		return -EINVAL;
+
+	mutex_lock(&addi_serial_ports_lock);
+	ret = addi_serial_pps_set(ap, delta);
+	mutex_unlock(&addi_serial_ports_lock);
+
+	return ret ?: count;
+}
+
+static struct kobj_attribute addi_port_index_attr = __ATTR_RO(index);
+static struct kobj_attribute addi_port_line_attr = __ATTR_RO(line);
+static struct kobj_attribute addi_port_tty_attr = __ATTR_RO(tty);
+static struct kobj_attribute addi_port_warm_attr = __ATTR_RW(warm);
+static struct kobj_attribute addi_port_tx_ring_size_attr = __ATTR_RW(tx_ring_size);
+static struct kobj_attribute addi_port_tx_wake_pct_attr = __ATTR_RW(tx_wake_pct);
+static struct kobj_attribute addi_port_rx_cpu_attr = __ATTR_RW(rx_cpu);
+static struct kobj_attribute addi_port_irq_prio_attr = __ATTR_RW(irq_prio);
+static struct kobj_attribute addi_port_irq_budget_attr = __ATTR_RW(irq_budget);
+static struct kobj_attribute addi_port_latency_us_attr = __ATTR_RW(latency_us);
+static struct kobj_attribute addi_port_latency_scope_attr = __ATTR_RW(latency_scope);
+static struct kobj_attribute addi_port_bridge_attr = __ATTR_RW(bridge);
+static struct kobj_attribute addi_port_bridge_monitor_attr = __ATTR_RW(bridge_monitor);
+static struct kobj_attribute addi_port_group_attr = __ATTR_RW(group);
+static struct kobj_attribute addi_port_capture_attr = __ATTR_RW(capture);
+static struct kobj_attribute addi_port_pps_attr = __ATTR_RW(pps);
+
+static struct attribute *addi_port_attrs[] = {
+	&addi_port_index_attr.attr,
+	&addi_port_line_attr.attr,
+	&addi_port_tty_attr.attr,
+	&addi_port_warm_attr.attr,
+	&addi_port_tx_ring_size_attr.attr,
+	&addi_port_tx_wake_pct_attr.attr,
+	&addi_port_rx_cpu_attr.attr,
+	&addi_port_irq_prio_attr.attr,
+	&addi_port_irq_budget_attr.attr,
+	&addi_port_latency_us_attr.attr,
+	&addi_port_latency_scope_attr.attr,
+	&addi_port_bridge_attr.attr,
+	&addi_port_bridge_monitor_attr.attr,
+	&addi_port_group_attr.attr,
+	&addi_port_capture_attr.attr,
+	&addi_port_pps_attr.attr,
+	NULL,
+};
+
+static void addi_port_release(struct kobject *kobj)
+{
+	struct addi_port *ap = to_addi_port(kobj);
+
+	kvfree(ap->ring.buf);
+	kfree(ap->resp);
+	kfree(ap);
+}
+
+static struct kobj_type addi_port_ktype = {
+	.release = addi_port_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_attrs = addi_port_attrs,
+};
+
+/*
+ * debugfs: addi_serial/<pci device>/portN, one file of counters per port.
+ */
+/* Bucket n counts durations below 2^n us, the last one everything longer */
+static void addi_port_hist_show(struct seq_file *m, const char *name,
+								const u32 *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:", name);
+	for (i = 0; i < ADDI_SERIAL_HIST_BUCKETS; i++)
+		seq_printf(m, " %u", hist[i]);
+	seq_putc(m, '\n');
+}
+
+static int addi_port_stats_show(struct seq_file *m, void *v)
+{
+	struct addi_port *ap = m->private;
+	struct uart_port *port = &ap->up->port;
+	unsigned long flags;
+	typeof(ap->stats) st;
+	u64 tx;
+
+	spin_lock_irqsave(&port->lock, flags);
+	st = ap->stats;
+	tx = port->icount.tx;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	seq_printf(m, "line: %d\n", ap->line);
+	seq_printf(m, "char_ns: %llu\n", ap->char_ns);
+	mutex_lock(&ap->qos_lock);
+	if (pm_qos_request_active(&ap->qos))
+		seq_printf(m, "qos: global %d us\n", ap->latency_us);
+	else if (ap->qos_cpu >= 0)
+		seq_printf(m, "qos: cpu%d %d us\n", ap->qos_cpu, ap->latency_us);
+	else
+		seq_puts(m, "qos: none\n");
+	mutex_unlock(&ap->qos_lock);
+	seq_printf(m, "tx_ring: %u/%u\n", addi_tx_ring_count(&ap->ring),
+			   ap->ring.size);
+	seq_printf(m, "tx_bytes: %llu\n", tx);
+	seq_printf(m, "tx_writes_lockless: %llu\n", st.tx_writes_lockless);
+	seq_printf(m, "tx_writes_locked: %llu\n", st.tx_writes_locked);
+	seq_printf(m, "tx_lock_contended: %llu\n",
+			   (u64)atomic64_read(&st.tx_lock_contended));
+	seq_printf(m, "tx_spill_busy: %llu\n", st.tx_spill_busy);
+	seq_printf(m, "tx_wakeups: %llu\n", st.tx_wakeups);
+	seq_printf(m, "tx_wakeups_per_mb: %llu\n",
+			   tx ? div64_u64(st.tx_wakeups << 20, tx) : 0);
+	seq_printf(m, "ldisc_rx_bytes: %llu\n", st.ldisc_rx_bytes);
+	seq_printf(m, "ldisc_rx_errors: %llu\n", st.ldisc_rx_errors);
+	seq_printf(m, "ldisc_rx_stalls: %llu\n", st.ldisc_rx_stalls);
+	seq_printf(m, "ldisc_reads: %llu\n", st.ldisc_reads);
+	seq_printf(m, "ldisc_tx_bytes: %llu\n", st.ldisc_tx_bytes);
+	seq_printf(m, "ldisc_writes: %llu\n", st.ldisc_writes);
+	seq_printf(m, "rx_push_local: %llu\n", st.rx_push_local);
+	seq_printf(m, "rx_push_steered: %llu\n", st.rx_push_steered);
+	seq_printf(m, "rx_reader_remote: %llu\n", st.rx_reader_remote);
+	seq_printf(m, "bridge_bytes: %llu\n", st.bridge_bytes);
+	seq_printf(m, "bridge_drops: %llu\n", st.bridge_drops);
+	seq_printf(m, "group_writes: %llu\n", st.group_writes);
+	seq_printf(m, "group_bytes: %llu\n", st.group_bytes);
+	seq_printf(m, "sync_starts: %llu\n", st.sync_starts);
+	seq_printf(m, "sync_skew_ns: %llu\n", st.sync_skew_ns);
+	seq_printf(m, "sync_skew_max_ns: %llu\n", st.sync_skew_max_ns);
+	seq_printf(m, "resp_matches: %llu\n", st.resp_matches);
+	seq_printf(m, "resp_bytes: %llu\n", st.resp_bytes);
+	seq_printf(m, "resp_drops: %llu\n", st.resp_drops);
+	seq_printf(m, "frames: %llu\n", st.frames);
+	seq_printf(m, "frame_errors: %llu\n", st.frame_errors);
+	seq_printf(m, "frame_crc_errors: %llu\n", st.frame_crc_errors);
+	seq_printf(m, "console_bytes: %llu\n", st.console_bytes);
+	seq_printf(m, "console_drops: %llu\n", st.console_drops);
+	seq_printf(m, "edges: %llu\n", st.edges);
+	seq_printf(m, "edge_latency_ns: %llu\n", st.edge_latency_ns);
+	seq_printf(m, "edge_latency_max_ns: %llu\n", st.edge_latency_max_ns);
+	seq_printf(m, "edge_jitter_ns: %llu\n", st.edge_jitter_ns);
+	seq_printf(m, "edge_jitter_max_ns: %llu\n", st.edge_jitter_max_ns);
+	seq_printf(m, "autobaud_runs: %llu\n", st.autobaud_runs);
+	seq_printf(m, "autobaud_steps: %llu\n", st.autobaud_steps);
+	seq_printf(m, "autobaud_ms: %llu\n", st.autobaud_ms);
+	seq_printf(m, "autobaud_baud: %u\n", ap->ab_baud);
+	seq_printf(m, "irq_prio: %u\n", ap->irq_prio);
+	seq_printf(m, "irq_budget: %u\n", ap->irq_budget);
+	seq_printf(m, "isr_services: %llu\n", st.isr_services);
+	seq_printf(m, "isr_deferred: %llu\n", st.isr_deferred);
+	seq_printf(m, "isr_wait_avg_ns: %llu\n",
+			   st.isr_services ? div64_u64(st.isr_wait_ns, st.isr_services) : 0);
+	seq_printf(m, "isr_wait_max_ns: %llu\n", st.isr_wait_max_ns);
+	seq_printf(m, "drains: %llu\n", st.drains);
+	seq_printf(m, "drain_overshoot_avg_ns: %llu\n",
+			   st.drains ? div64_u64(st.drain_overshoot_ns, st.drains) : 0);
+	seq_printf(m, "drain_overshoot_max_ns: %llu\n", st.drain_overshoot_max_ns);
+	seq_printf(m, "speed_changes: %llu\n", st.speed_changes);
+	seq_printf(m, "speed_tx_busy: %llu\n", st.speed_tx_busy);
+	seq_printf(m, "speed_wait_ns: %llu\n", st.speed_wait_ns);
+	seq_printf(m, "speed_switch_ns: %llu\n", st.speed_switch_ns);
+	seq_printf(m, "speed_switch_max_ns: %llu\n", st.speed_switch_max_ns);
+	addi_port_hist_show(m, "open_cold_us", st.open_cold);
+	addi_port_hist_show(m, "open_warm_us", st.open_warm);
+	addi_port_hist_show(m, "close_cold_us", st.close_cold);
+	addi_port_hist_show(m, "close_warm_us", st.close_warm);
+	addi_port_hist_show(m, "isr_wait_us", st.isr_wait);
+	return 0;
+}
+
+static int addi_port_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, addi_port_stats_show, inode->i_private);
+}
+
+static const struct file_operations addi_port_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = addi_port_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* addi_serial/<pci device>/board: interrupt load of the whole board */
+static int addi_board_stats_show(struct seq_file *m, void *v)
+{
+	struct serial_private *priv = m->private;
+
+	mutex_lock(&addi_serial_boards_lock);
+	seq_printf(m, "irq: %u\n", priv->irq);
+	seq_printf(m, "irq_cpu: %d\n", priv->irq_cpu);
+	seq_printf(m, "irqs: %llu\n", (u64)atomic64_read(&priv->irqs));
+	seq_printf(m, "irq_rate: %llu\n", priv->irq_rate);
+	seq_printf(m, "irq_moves: %llu\n", priv->irq_moves);
+	mutex_unlock(&addi_serial_boards_lock);
+	seq_printf(m, "board_irq: %s\n", READ_ONCE(priv->irq_owned) ? "on" : "off");
+	seq_printf(m, "gisr: %s\n", !priv->gisr ? "none" :
+			   READ_ONCE(priv->gisr_on) ? "on" : "off");
+	seq_printf(m, "gisr_reads: %llu\n", priv->gisr_reads);
+	seq_printf(m, "gisr_misses: %llu\n", priv->gisr_misses);
+
+	mutex_lock(&addi_serial_ports_lock);
+	if (priv->cap)
+	{
+		seq_printf(m, "capture_size: %u\n", priv->cap->size);
+		seq_printf(m, "capture_records: %llu\n", priv->cap->records);
+		seq_printf(m, "capture_overwritten: %llu\n", priv->cap->overwritten);
+	}
+	mutex_unlock(&addi_serial_ports_lock);
+	return 0;
+}
+
+static int addi_board_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, addi_board_stats_show, inode->i_private);
+}
+
+static const struct file_operations addi_board_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = addi_board_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * addi_serial/<pci device>/capture: the capture ring as a pcap file,
+ * converted from a snapshot taken at open.
+ */
+#define ADDI_PCAP_MAGIC_NS 0xa1b23c4d
+#define ADDI_PCAP_LINKTYPE_USER0 147
+
+struct addi_pcap_hdr
+{
+	u32 magic;
+	u16 major;
+	u16 minor;
+	s32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+};
+
+struct addi_pcap_rec
+{
+	u32 sec;
+	u32 nsec;
+	u32 incl_len;
+	u32 orig_len;
+};
+
+struct addi_pcap_file
+{
+	size_t len;
+	unsigned char data[];
+};
+
+/* Bytes copied per hold of the capture lock, see addi_capture_snapshot() */
+#define ADDI_CAPTURE_CHUNK 4096
+
+/* Length of the whole records at the start of @snap */
+static u32 addi_capture_whole(const unsigned char *snap, u32 len)
+{
+	struct addi_cap_rec rec;
+	u32 pos = 0;
+
+	while (pos + sizeof(rec) <= len)
+	{
+		memcpy(&rec, snap + pos, sizeof(rec));
+		if (pos + sizeof(rec) + rec.len > len)
+			break;
+		pos += sizeof(rec) + rec.len;
+	}
+	return pos;
+}
+
+/*
+ * Copy the records in @cap to @snap, which holds cap->size bytes.  The
+ * ring is copied a chunk at a time, so the ISRs never spin on the lock
+ * for longer than one chunk.  If the writers overwrite bytes not yet
+ * copied, the partial record is dropped and the copy goes on from the
+ * new oldest record; what was copied before stays valid.  Records
+ * written after the start are left out.  Returns the bytes copied.
+ */
+static u32 addi_capture_snapshot(struct addi_capture *cap,
+								 unsigned char *snap)
+{
+	unsigned long flags;
+	u64 pos, end;
+	u32 len = 0, n;
+
+	spin_lock_irqsave(&cap->lock, flags);
+	pos = cap->tail;
+	end = cap->head;
+	spin_unlock_irqrestore(&cap->lock, flags);
+
+	while (pos < end)
+	{
+		spin_lock_irqsave(&cap->lock, flags);
+		if (cap->tail > pos)
+		{
+			len = addi_capture_whole(snap, len);
+			pos = cap->tail;
+			if (pos >= end)
+			{
+				spin_unlock_irqrestore(&cap->lock, flags);
+				break;
+			}
+		}
+		n = min_t(u64, end - pos, ADDI_CAPTURE_CHUNK);
+		addi_capture_peek(cap, pos, snap + len, n);
+		spin_unlock_irqrestore(&cap->lock, flags);
+
+		pos += n;
+		len += n;
+		cond_resched();
+	}
+	return len;
+}
+
+static int addi_capture_open(struct inode *inode, struct file *file)
+{
+	struct serial_private *priv = inode->i_private;
+	struct addi_pcap_hdr hdr = {
+		.magic = ADDI_PCAP_MAGIC_NS,
+		.major = 2,
+		.minor = 4,
+		.snaplen = ADDI_CAPTURE_BURST + sizeof(struct addi_serial_cap_hdr),
+		.linktype = ADDI_PCAP_LINKTYPE_USER0,
+	};
+	struct addi_serial_cap_hdr ch = {};
+	struct addi_capture *cap;
+	struct addi_pcap_file *pf;
+	struct addi_pcap_rec pr;
+	struct addi_cap_rec rec;
+	unsigned char *snap = NULL, *out;
+	u32 len = 0, pos, size;
+	u64 records = 0;
+
+	mutex_lock(&addi_serial_ports_lock);
+	cap = priv->cap;
+	if (cap)
+	{
+		snap = kvmalloc(cap->size, GFP_KERNEL);
+		if (!snap)
+		{
+			mutex_unlock(&addi_serial_ports_lock);
+			return -ENOMEM;
+		}
+		len = addi_capture_snapshot(cap, snap);
+	}
+	mutex_unlock(&addi_serial_ports_lock);
+
+	for (pos = 0; pos < len; pos += sizeof(rec) + rec.len, records++)
+		memcpy(&rec, snap + pos, sizeof(rec));
+
+	/* Each record loses its own header and gains a pcap and a port one */
+	size = sizeof(hdr) + len +
+		   records * (sizeof(pr) + sizeof(ch) - sizeof(rec));
+	pf = kvmalloc(sizeof(*pf) + size, GFP_KERNEL);
+	if (!pf)
+	{
+		kvfree(snap);
+		return -ENOMEM;
+	}
+
+	out = pf->data;
+	memcpy(out, &hdr, sizeof(hdr));
+	out += sizeof(hdr);
+	for (pos = 0; pos < len; pos += sizeof(rec) + rec.len)
+	{
+		memcpy(&rec, snap + pos, sizeof(rec));
+		pr.sec = div_u64_rem(rec.ts, NSEC_PER_SEC, &pr.nsec);
+		pr.incl_len = pr.orig_len = sizeof(ch) + rec.len;
+		ch.port = rec.port;
+		ch.flags = rec.flags;
+		memcpy(out, &pr, sizeof(pr));
+		out += sizeof(pr);
+		memcpy(out, &ch, sizeof(ch));
+		out += sizeof(ch);
+		memcpy(out, snap + pos + sizeof(rec), rec.len);
+		out += rec.len;
+	}
+	pf->len = out - pf->data;
+	kvfree(snap);
+
+	file->private_data = pf;
+	return 0;
+}
+
+static ssize_t addi_capture_read(struct file *file, char __user *buf,
+								 size_t count, loff_t *ppos)
+{
+	struct addi_pcap_file *pf = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, pf->data, pf->len);
+}
+
+static int addi_capture_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations addi_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = addi_capture_open,
+	.read = addi_capture_read,
+	.llseek = default_llseek,
+	.release = addi_capture_release,
+};
+
+/*
+ * ttyAD<line>: kernel console on a port of this driver, selected with
+ * console=ttyAD<line>[,options].  printk only copies into
+ * addi_con_ring and queues an irq_work; the port's TX refill sends it
+ * when the port is open, a polling hrtimer when it is not.  Only while
+ * an oops is in progress is output written synchronously.
+ */
+static struct irq_work addi_con_work;
+static struct hrtimer addi_con_timer;
+
+static void addi_console_putchar(struct uart_port *port, int ch)
+{
+	struct uart_8250_port *up = up_to_u8250p(port);
+	unsigned int tmout = 10000;
+
+	while (!(serial_in(up, UART_LSR) & UART_LSR_THRE) && --tmout)
+		udelay(1);
+	serial_out(up, UART_TX, ch);
+}
+
+/* The old, blocking way, for oopses and panics */
+static void addi_console_write_sync(struct addi_port *ap, const char *s,
+									unsigned int count)
+{
+	struct uart_8250_port *up = ap->up;
+	struct uart_port *port = &up->port;
+	struct addi_tx_ring *ring = &addi_con_ring;
+	unsigned int tmout = 10000;
+	unsigned long flags;
+	unsigned char ier;
+	int locked;
+
+	locked = spin_trylock_irqsave(&port->lock, flags);
+	ier = serial_in(up, UART_IER);
+	serial_out(up, UART_IER, 0);
+
+	/* What was buffered comes first, unless someone else is sending it */
+	while (locked && addi_tx_ring_count(ring))
+		addi_console_putchar(port,
+							 ring->buf[ring->tail++ & (ring->size - 1)]);
+	uart_console_write(port, s, count, addi_console_putchar);
+
+	while (!(serial_in(up, UART_LSR) & UART_LSR_TEMT) && --tmout)
+		udelay(1);
+	serial_out(up, UART_IER, ier);
+	if (locked)
+		spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static void addi_console_write(struct console *co, const char *s,
+							   unsigned int count)
+{
+	struct addi_port *ap = READ_ONCE(addi_con_port);
+	struct addi_tx_ring *ring = &addi_con_ring;
+	u32 head, tail;
+
+	if (!ap)
+		return;
+	if (unlikely(oops_in_progress))
+	{
+		addi_console_write_sync(ap, s, count);
+		return;
+	}
+
+	head = ring->head;
+	tail = READ_ONCE(ring->tail);
+	for (; count; count--, s++)
+	{
+		if (head - tail + (*s == '\n') >= ring->size)
+			break;
+		if (*s == '\n')
+			ring->buf[head++ & (ring->size - 1)] = '\r';
+		ring->buf[head++ & (ring->size - 1)] = *s;
+	}
+	smp_store_release(&ring->head, head);
+	ap->stats.console_drops += count;
+
+	irq_work_queue(&addi_con_work);
+}
+
+/*
+ * Get the ring moving.  Runs from the irq_work, so never inside a
+ * printk() that came from under the port lock.
+ */
+static void addi_console_kick(struct irq_work *work)
+{
+	struct addi_port *ap = READ_ONCE(addi_con_port);
+	struct uart_port *port;
+	unsigned long flags;
+
+	if (!ap)
+		return;
+	port = &ap->up->port;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (ap->state == ADDI_PORT_ACTIVE)
+	{
+		if (!uart_tx_stopped(port))
+			port->ops->start_tx(port);
+	}
+	else if (!hrtimer_is_queued(&addi_con_timer))
+	{
+		/*
+		 * Also while the poll callback runs: it may already have
+		 * found the ring empty, and then it does not come back.
+		 */
+		hrtimer_start(&addi_con_timer, 0, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+/* Send the ring by polling while the port is closed and has no IRQ */
+static enum hrtimer_restart addi_console_poll(struct hrtimer *timer)
+{
+	struct addi_port *ap = READ_ONCE(addi_con_port);
+	struct uart_8250_port *up;
+	unsigned long flags;
+	bool more;
+
+	if (!ap)
+		return HRTIMER_NORESTART;
+	up = ap->up;
+
+	spin_lock_irqsave(&up->port.lock, flags);
+	if (ap->state == ADDI_PORT_ACTIVE)
+	{
+		/* Opened meanwhile: the interrupt path takes over */
+		if (!uart_tx_stopped(&up->port))
+			up->port.ops->start_tx(&up->port);
+		more = false;
+	}
+	else
+	{
+		if (serial_in(up, UART_LSR) & UART_LSR_THRE)
+			addi_serial_tx_console(ap, up->tx_loadsz);
+		more = addi_tx_ring_count(&addi_con_ring);
+	}
+	/* A kick while we ran has queued us again already */
+	if (hrtimer_is_queued(timer))
+		more = false;
+	/* Come back when about one FIFO load has gone out */
+	else if (more)
+		hrtimer_forward_now(timer,
+							ns_to_ktime(max_t(u64, ap->char_ns * up->tx_loadsz,
+											  NSEC_PER_USEC * 100)));
+	spin_unlock_irqrestore(&up->port.lock, flags);
+
+	return more ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+static int addi_console_setup(struct console *co, char *options)
+{
+	int baud = 115200, bits = 8, parity = 'n', flow = 'n';
+	struct addi_port *ap, *found = NULL;
+	struct tty_port *tport;
+	int ret;
+
+	mutex_lock(&addi_serial_ports_lock);
+	list_for_each_entry(ap, &addi_serial_ports, node)
+	{
+		if (ap->line == co->index)
+		{
+			found = ap;
+			break;
+		}
+	}
+	mutex_unlock(&addi_serial_ports_lock);
+	if (!found)
+		return -ENODEV;
+
+	if (options)
+		uart_parse_options(options, &baud, &parity, &bits, &flow);
+
+	/*
+	 * uart_set_options() reinitialises port->lock and calls
+	 * set_termios() without the port mutex, so it is only safe on a
+	 * port nobody has open, and the mutex keeps it that way meanwhile.
+	 */
+	tport = &found->up->port.state->port;
+	mutex_lock(&tport->mutex);
+	if (found->state != ADDI_PORT_COLD)
+	{
+		mutex_unlock(&tport->mutex);
+		return -EBUSY;
+	}
+	/* Makes the serial core keep the port powered and configured */
+	found->up->port.cons = co;
+	ret = uart_set_options(&found->up->port, co, baud, parity, bits, flow);
+	if (ret)
+		found->up->port.cons = NULL;
+	else
+		WRITE_ONCE(addi_con_port, found);
+	mutex_unlock(&tport->mutex);
+
+	return ret;
+}
+
+static struct console addi_console = {
+	.name = "ttyAD",
+	.write = addi_console_write,
+	.setup = addi_console_setup,
+	.flags = CON_PRINTBUFFER,
+	.index = -1,
+};
+
+/* Stop the console before @ap goes away */
+static void addi_console_detach(struct addi_port *ap)
+{
+	if (READ_ONCE(addi_con_port) != ap)
+		return;
+
+	unregister_console(&addi_console);
+	WRITE_ONCE(addi_con_port, NULL);
+	irq_work_sync(&addi_con_work);
+	hrtimer_cancel(&addi_con_timer);
+	ap->up->port.cons = NULL;
+}
+
+/*
+ * addi_raw: binary line discipline for bulk data ports.
+ *
+ * Received data goes from the flip buffer into a kfifo and from there
+ * to userspace with one copy, without n_tty's per-character processing
+ * and canonical/echo handling.  Writes go straight into the port's TX
+ * ring.  read() honours VMIN/VTIME; flags are counted, not reported.
+ * Only ports driven by this module can select it.
+ *
+ * With framing on, only whole frames go into the kfifo, their lengths
+ * into frames, and read() returns one frame at a time.
+ */
+#define ADDI_LDISC_FRAMES 256
+#define ADDI_LDISC_FRAME_MAX 4096
+
+struct addi_ldisc
+{
+	struct tty_struct *tty;
+	struct addi_port *ap;
+	struct kfifo rx;
+	struct mutex read_lock;
+	bool stalled;
+
+	/*
+	 * Framing state, under cfg_lock.  frame holds the frame being
+	 * received; fpending is set while a complete one waits for room.
+	 */
+	struct mutex cfg_lock;
+	struct addi_serial_framing cfg;
+	DECLARE_KFIFO_PTR(frames, u32);
+	unsigned char *frame;
+	unsigned int flen;
+	unsigned int ftotal;
+	bool fbad;
+	bool fpending;
+};
+
+static bool addi_ldisc_registered;
+
+static struct addi_port *addi_ldisc_find_port(struct tty_struct *tty)
+{
+	struct addi_port *ap, *found = NULL;
+
+	mutex_lock(&addi_serial_ports_lock);
+	list_for_each_entry(ap, &addi_serial_ports, node)
+	{
+		if (ap->up->port.state == tty->driver_data)
+		{
+			found = ap;
+			break;
+		}
+	}
+	mutex_unlock(&addi_serial_ports_lock);
+
+	return found;
+}
+
+static int addi_ldisc_open(struct tty_struct *tty)
+{
+	struct addi_ldisc *ld;
+	struct addi_port *ap;
+
+	ap = addi_ldisc_find_port(tty);
+	if (!ap)
+		return -ENODEV;
+
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
+		return -ENOMEM;
+	if (kfifo_alloc(&ld->rx, ldisc_rx_size, GFP_KERNEL))
+	{
+		kfree(ld);
+		return -ENOMEM;
+	}
+	if (kfifo_alloc(&ld->frames, ADDI_LDISC_FRAMES, GFP_KERNEL))
+	{
+		kfifo_free(&ld->rx);
+		kfree(ld);
+		return -ENOMEM;
+	}
+
+	ld->tty = tty;
+	ld->ap = ap;
+	mutex_init(&ld->read_lock);
+	mutex_init(&ld->cfg_lock);
+	tty->disc_data = ld;
+	tty->receive_room = kfifo_size(&ld->rx);
+	/* Let tty_write() hand us up to 64 KiB per call */
+	set_bit(TTY_NO_WRITE_SPLIT, &tty->flags);
+
+	return 0;
+}
+
+static void addi_ldisc_close(struct tty_struct *tty)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+
+	clear_bit(TTY_NO_WRITE_SPLIT, &tty->flags);
+	tty->disc_data = NULL;
+	kfifo_free(&ld->frames);
+	kfifo_free(&ld->rx);
+	kvfree(ld->frame);
+	kfree(ld);
+}
+
+/* Have flush_to_ldisc() retry what we could not take */
+static void addi_ldisc_restart(struct addi_ldisc *ld)
+{
+	if (READ_ONCE(ld->stalled))
+	{
+		WRITE_ONCE(ld->stalled, false);
+		tty_schedule_flip(ld->tty->port);
+	}
+}
+
+static void addi_ldisc_flush_buffer(struct tty_struct *tty)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+
+	mutex_lock(&ld->cfg_lock);
+	mutex_lock(&ld->read_lock);
+	kfifo_reset_out(&ld->rx);
+	kfifo_reset_out(&ld->frames);
+	mutex_unlock(&ld->read_lock);
+	ld->flen = ld->ftotal = 0;
+	ld->fbad = ld->fpending = false;
+	mutex_unlock(&ld->cfg_lock);
+	addi_ldisc_restart(ld);
+}
+
+/* Queue the complete frame, false if the reader has to make room first */
+static bool addi_ldisc_frame_queue(struct addi_ldisc *ld)
+{
+	if (kfifo_avail(&ld->rx) < ld->flen || kfifo_is_full(&ld->frames))
+		return false;
+
+	/* Data first: the reader goes by frames */
+	kfifo_in(&ld->rx, ld->frame, ld->flen);
+	kfifo_put(&ld->frames, ld->flen);
+	ld->ap->stats.frames++;
+	ld->flen = ld->ftotal = 0;
+	ld->fpending = false;
+	return true;
+}
+
+/* Check and strip the CRC of a complete frame */
+static bool addi_ldisc_frame_crc(struct addi_ldisc *ld)
+{
+	unsigned int n;
+	bool good;
+
+	switch (ld->cfg.crc)
+	{
+	case ADDI_SERIAL_FRAME_CRC16:
+		if (ld->flen < 2)
+			goto bad;
+		n = ld->flen - 2;
+		good = crc16(0xffff, ld->frame, n) ==
+			   get_unaligned_le16(ld->frame + n);
+		break;
+	case ADDI_SERIAL_FRAME_CRC32:
+		if (ld->flen < 4)
+			goto bad;
+		n = ld->flen - 4;
+		good = ~crc32_le(~0, ld->frame, n) ==
+			   get_unaligned_le32(ld->frame + n);
+		break;
+	default:
+		return true;
+	}
+	if (!good)
+		goto bad;
+
+	ld->flen = n;
+	return true;
+bad:
+	ld->ap->stats.frame_crc_errors++;
+	return false;
+}
+
+/* End of a frame: false if it is held back for lack of room */
+static bool addi_ldisc_frame_end(struct addi_ldisc *ld)
+{
+	if (ld->fbad || !ld->flen || !addi_ldisc_frame_crc(ld))
+	{
+		ld->flen = ld->ftotal = 0;
+		ld->fbad = false;
+		return true;
+	}
+
+	ld->fpending = true;
+	return addi_ldisc_frame_queue(ld);
+}
+
+static void addi_ldisc_frame_error(struct addi_ldisc *ld)
+{
+	if (!ld->fbad)
+		ld->ap->stats.frame_errors++;
+	ld->fbad = true;
+}
+
+/* Length field once the frame header is in, 0 if it is out of range */
+static unsigned int addi_ldisc_frame_total(struct addi_ldisc *ld)
+{
+	const struct addi_serial_framing *cfg = &ld->cfg;
+	const unsigned char *p = ld->frame + cfg->len_offset;
+	bool be = cfg->len_flags & ADDI_SERIAL_FRAME_LEN_BE;
+	unsigned int head = cfg->len_offset + cfg->len_width;
+	s64 total;
+
+	switch (cfg->len_width)
+	{
+	case 1:
+		total = *p;
+		break;
+	case 2:
+		total = be ? get_unaligned_be16(p) : get_unaligned_le16(p);
+		break;
+	default:
+		total = be ? get_unaligned_be32(p) : get_unaligned_le32(p);
+		break;
+	}
+	total += cfg->len_adjust;
+
+	if (total < head || total > cfg->max_len)
+		return 0;
+	return total;
+}
+
+/*
+ * Feed one received byte to the framer.  Returns false when a complete
+ * frame could not be queued; the byte has been taken all the same.
+ */
+static bool addi_ldisc_frame_byte(struct addi_ldisc *ld, unsigned char ch,
+								  char flag)
+{
+	const struct addi_serial_framing *cfg = &ld->cfg;
+
+	if (flag != TTY_NORMAL)
+		addi_ldisc_frame_error(ld);
+
+	/* Too long: drop it, but keep looking for the delimiter */
+	if (ld->flen == cfg->max_len)
+	{
+		addi_ldisc_frame_error(ld);
+		ld->flen = 0;
+	}
+	ld->frame[ld->flen++] = ch;
+
+	if (cfg->mode == ADDI_SERIAL_FRAME_DELIM)
+	{
+		if (ld->flen < cfg->delim_len ||
+			memcmp(ld->frame + ld->flen - cfg->delim_len, cfg->delim,
+				   cfg->delim_len))
+			return true;
+		ld->flen -= cfg->delim_len;
+		return addi_ldisc_frame_end(ld);
+	}
+
+	if (!ld->ftotal)
+	{
+		if (ld->flen < cfg->len_offset + cfg->len_width)
+			return true;
+		ld->ftotal = addi_ldisc_frame_total(ld);
+		/* No way to resync within the frame; start over */
+		if (!ld->ftotal)
+		{
+			addi_ldisc_frame_error(ld);
+			ld->flen = 0;
+			ld->fbad = false;
+			return true;
+		}
+	}
+	if (ld->flen < ld->ftotal)
+		return true;
+	return addi_ldisc_frame_end(ld);
+}
+
+/* A reader made room: queue the frame that was held back */
+static void addi_ldisc_frame_retry(struct addi_ldisc *ld)
+{
+	mutex_lock(&ld->cfg_lock);
+	if (ld->fpending && addi_ldisc_frame_queue(ld))
+		wake_up_interruptible_poll(&ld->tty->read_wait, POLLIN);
+	mutex_unlock(&ld->cfg_lock);
+}
+
+static int addi_ldisc_receive_frames(struct addi_ldisc *ld,
+									 const unsigned char *cp, char *fp,
+									 int count)
+{
+	unsigned int frames = kfifo_len(&ld->frames);
+	int i = 0;
+
+	if (!ld->fpending)
+		for (i = 0; i < count; i++)
+			if (!addi_ldisc_frame_byte(ld, cp[i], fp ? fp[i] : TTY_NORMAL))
+			{
+				i++;
+				break;
+			}
+
+	if (ld->fpending)
+	{
+		ld->ap->stats.ldisc_rx_stalls++;
+		WRITE_ONCE(ld->stalled, true);
+	}
+	ld->ap->stats.ldisc_rx_bytes += i;
+	if (kfifo_len(&ld->frames) != frames)
+		wake_up_interruptible_poll(&ld->tty->read_wait, POLLIN);
+
+	return i;
+}
+
+static int addi_ldisc_receive_buf2(struct tty_struct *tty,
+								   const unsigned char *cp, char *fp,
+								   int count)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+	struct addi_port *ap = ld->ap;
+	unsigned int n;
+	int i;
+
+	mutex_lock(&ld->cfg_lock);
+	if (ld->cfg.mode != ADDI_SERIAL_FRAME_OFF)
+	{
+		n = addi_ldisc_receive_frames(ld, cp, fp, count);
+		mutex_unlock(&ld->cfg_lock);
+		return n;
+	}
+	mutex_unlock(&ld->cfg_lock);
+
+	n = kfifo_in(&ld->rx, cp, count);
+	if (n < count)
+	{
+		ap->stats.ldisc_rx_stalls++;
+		WRITE_ONCE(ld->stalled, true);
+		/* Pairs with the barrier after the reader's copy */
+		smp_mb();
+		if (kfifo_avail(&ld->rx))
+			addi_ldisc_restart(ld);
+	}
+
+	if (fp)
+		for (i = 0; i < n; i++)
+			if (fp[i] != TTY_NORMAL)
+				ap->stats.ldisc_rx_errors++;
+
+	ap->stats.ldisc_rx_bytes += n;
+	if (n)
+		wake_up_interruptible_poll(&tty->read_wait, POLLIN);
+
+	return n;
+}
+
+static bool addi_ldisc_framed(struct addi_ldisc *ld)
+{
+	return READ_ONCE(ld->cfg.mode) != ADDI_SERIAL_FRAME_OFF;
+}
+
+/* With framing, @want is 1 and means a whole frame */
+static bool addi_ldisc_readable(struct addi_ldisc *ld, struct file *file,
+								unsigned int want)
+{
+	bool ready;
+
+	if (addi_ldisc_framed(ld))
+		ready = !kfifo_is_empty(&ld->frames);
+	else
+		ready = kfifo_len(&ld->rx) >= want;
+
+	return ready || tty_hung_up_p(file) ||
+		   test_bit(TTY_OTHER_CLOSED, &ld->tty->flags);
+}
+
+/* One frame to userspace; what does not fit in @nr is dropped */
+static int addi_ldisc_read_frame(struct addi_ldisc *ld,
+								 unsigned char __user *buf, size_t nr,
+								 unsigned int *copied)
+{
+	unsigned char skip[64];
+	unsigned int n;
+	u32 len;
+	int ret;
+
+	*copied = 0;
+	if (!kfifo_get(&ld->frames, &len))
+		return 0;
+	/* Pairs with the frame data going in before its length */
+	smp_rmb();
+
+	ret = kfifo_to_user(&ld->rx, buf, min_t(size_t, len, nr), copied);
+	len -= *copied;
+	while (len)
+	{
+		n = kfifo_out(&ld->rx, skip, min_t(u32, len, sizeof(skip)));
+		if (!n)
+			break;
+		len -= n;
+	}
+
+	return ret;
+}
+
+/*
+ * VMIN = 0: wait up to VTIME for any data.  VMIN > 0: wait for the
+ * first byte, then until VMIN bytes are there or VTIME passes without
+ * a new byte (forever if VTIME = 0).
+ */
+static void addi_ldisc_wait(struct addi_ldisc *ld, struct file *file,
+							unsigned int want, long timeout)
+{
+	wait_queue_head_t *wq = &ld->tty->read_wait;
+	unsigned int seen;
+	long left;
+
+	if (!want)
+	{
+		if (timeout)
+			wait_event_interruptible_timeout(*wq,
+											 addi_ldisc_readable(ld, file, 1),
+											 timeout);
+		return;
+	}
+
+	if (!timeout)
+	{
+		wait_event_interruptible(*wq, addi_ldisc_readable(ld, file, want));
+		return;
+	}
+
+	if (wait_event_interruptible(*wq, addi_ldisc_readable(ld, file, 1)))
+		return;
+
+	do
+	{
+		seen = kfifo_len(&ld->rx);
+		left = wait_event_interruptible_timeout(*wq,
+												kfifo_len(&ld->rx) != seen ||
+													addi_ldisc_readable(ld, file, want),
+												timeout);
+	} while (left > 0 && !addi_ldisc_readable(ld, file, want));
+}
+
+static ssize_t addi_ldisc_read(struct tty_struct *tty, struct file *file,
+							   unsigned char __user *buf, size_t nr)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+	unsigned int copied, want;
+	bool framed;
+	int ret;
+
+	if (!nr)
+		return 0;
+
+	WRITE_ONCE(ld->ap->reader_cpu, raw_smp_processor_id());
+	framed = addi_ldisc_framed(ld);
+	want = min_t(size_t, nr, MIN_CHAR(tty));
+	if (framed)
+		want = min(want, 1U);
+	if (!tty_io_nonblock(tty, file))
+		addi_ldisc_wait(ld, file, want, TIME_CHAR(tty) * HZ / 10);
+
+	if (mutex_lock_interruptible(&ld->read_lock))
+		return -ERESTARTSYS;
+	if (framed)
+		ret = addi_ldisc_read_frame(ld, buf, nr, &copied);
+	else
+		ret = kfifo_to_user(&ld->rx, buf, nr, &copied);
+	mutex_unlock(&ld->read_lock);
+	if (ret)
+		return ret;
+
+	/* Pairs with the barrier in addi_ldisc_receive_buf2() */
+	smp_mb();
+	if (framed)
+		addi_ldisc_frame_retry(ld);
+	addi_ldisc_restart(ld);
+
+	if (copied)
+	{
+		ld->ap->stats.ldisc_reads++;
+		return copied;
+	}
+	if (tty_hung_up_p(file) || test_bit(TTY_OTHER_CLOSED, &tty->flags))
+		return 0;
+	if (signal_pending(current))
+		return -ERESTARTSYS;
+	if (tty_io_nonblock(tty, file))
+		return -EAGAIN;
+	return 0;
+}
+
+static ssize_t addi_ldisc_write(struct tty_struct *tty, struct file *file,
+								const unsigned char *buf, size_t nr)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+	const unsigned char *b = buf;
+	ssize_t ret = 0;
+	unsigned int n;
+
+	add_wait_queue(&tty->write_wait, &wait);
+	while (nr)
+	{
+		if (signal_pending(current))
+		{
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if (tty_hung_up_p(file))
+		{
+			ret = -EIO;
+			break;
+		}
+
+		n = addi_serial_ring_write(ld->ap, b, nr);
+		b += n;
+		nr -= n;
+		if (!nr)
+			break;
+
+		if (tty_io_nonblock(tty, file))
+		{
+			ret = -EAGAIN;
+			break;
+		}
+		/* The refill may have freed space before it saw us blocked */
+		if (addi_serial_ring_room(ld->ap))
+			continue;
+		wait_woken(&wait, TASK_INTERRUPTIBLE, MAX_SCHEDULE_TIMEOUT);
+	}
+	remove_wait_queue(&tty->write_wait, &wait);
+
+	if (b == buf)
+		return ret;
+
+	ld->ap->stats.ldisc_writes++;
+	ld->ap->stats.ldisc_tx_bytes += b - buf;
+	return b - buf;
+}
+
+static unsigned int addi_ldisc_poll(struct tty_struct *tty, struct file *file,
+									poll_table *wait)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &tty->read_wait, wait);
+	poll_wait(file, &tty->write_wait, wait);
+
+	if (addi_ldisc_framed(ld) ? !kfifo_is_empty(&ld->frames) :
+								!kfifo_is_empty(&ld->rx))
+		mask |= POLLIN | POLLRDNORM;
+	if (tty_hung_up_p(file) || test_bit(TTY_OTHER_CLOSED, &tty->flags))
+		mask |= POLLHUP;
+	if (addi_serial_ring_room(ld->ap))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static int addi_ldisc_set_framing(struct addi_ldisc *ld,
+								  struct addi_serial_framing __user *argp)
+{
+	struct addi_serial_framing cfg;
+	unsigned char *frame = NULL;
+
+	if (copy_from_user(&cfg, argp, sizeof(cfg)))
+		return -EFAULT;
+	if (!cfg.max_len)
+		cfg.max_len = ADDI_LDISC_FRAME_MAX;
+	if (cfg.max_len > kfifo_size(&ld->rx) ||
+		cfg.crc > ADDI_SERIAL_FRAME_CRC32 ||
+		cfg.len_flags & ~ADDI_SERIAL_FRAME_LEN_BE)
+		return -EINVAL;
+
+	switch (cfg.mode)
+	{
+	case ADDI_SERIAL_FRAME_OFF:
+		break;
+	case ADDI_SERIAL_FRAME_DELIM:
+		if (!cfg.delim_len || cfg.delim_len > sizeof(cfg.delim))
+			return -EINVAL;
+		break;
+	case ADDI_SERIAL_FRAME_LENGTH:
+		if (cfg.len_width != 1 && cfg.len_width != 2 && cfg.len_width != 4)
+			return -EINVAL;
+		if (cfg.len_offset + cfg.len_width > cfg.max_len)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (cfg.mode != ADDI_SERIAL_FRAME_OFF)
+	{
+		frame = kvmalloc(cfg.max_len, GFP_KERNEL);
+		if (!frame)
+			return -ENOMEM;
+	}
+
+	/* Whatever was received so far was cut up the old way */
+	mutex_lock(&ld->cfg_lock);
+	mutex_lock(&ld->read_lock);
+	kfifo_reset_out(&ld->rx);
+	kfifo_reset_out(&ld->frames);
+	mutex_unlock(&ld->read_lock);
+	swap(ld->frame, frame);
+	ld->cfg = cfg;
+	ld->flen = ld->ftotal = 0;
+	ld->fbad = ld->fpending = false;
+	mutex_unlock(&ld->cfg_lock);
+	addi_ldisc_restart(ld);
+
+	kvfree(frame);
+	return 0;
+}
+
+static int addi_ldisc_ioctl(struct tty_struct *tty, struct file *file,
+							unsigned int cmd, unsigned long arg)
+{
+	struct addi_ldisc *ld = tty->disc_data;
+	struct addi_tx_ring *ring = &ld->ap->ring;
+	u32 len = 0;
+
+	switch (cmd)
+	{
+	case FIONREAD:
+		/* Framed: the size of the next frame, as for a datagram socket */
+		if (addi_ldisc_framed(ld))
+			kfifo_peek(&ld->frames, &len);
+		else
+			len = kfifo_len(&ld->rx);
+		return put_user(len, (int __user *)arg);
+	case ADDI_SERIAL_IOC_FRAMING:
+		return addi_ldisc_set_framing(ld, (void __user *)arg);
+	case TIOCOUTQ:
+		return put_user(tty_chars_in_buffer(tty) + addi_tx_ring_count(ring),
+						(int __user *)arg);
+	}
+
+	return n_tty_ioctl_helper(tty, file, cmd, arg);
+}
+
+static struct tty_ldisc_ops addi_ldisc_ops = {
+	.magic = TTY_LDISC_MAGIC,
+	.name = "addi_raw",
+	.open = addi_ldisc_open,
+	.close = addi_ldisc_close,
+	.flush_buffer = addi_ldisc_flush_buffer,
+	.read = addi_ldisc_read,
+	.write = addi_ldisc_write,
+	.ioctl = addi_ldisc_ioctl,
+	.poll = addi_ldisc_poll,
+	.receive_buf2 = addi_ldisc_receive_buf2,
+	.owner = THIS_MODULE,
+};
+
+/*
+ * Board level attributes, on the PCI device itself.
+ */
+static ssize_t slot_show(struct device *dev, struct device_attribute *attr,
+						 char *buf)
+{
+	struct pci_dev *pdev = to_pci_dev(dev);
+
+	return sprintf(buf, "%04x:%02x:%02x %d\n", pci_domain_nr(pdev->bus),
+				   pdev->bus->number, PCI_SLOT(pdev->devfn),
+				   pdev->slot ? (int)pdev->slot->number : -1);
+}
+
+static ssize_t line_base_show(struct device *dev,
+							  struct device_attribute *attr, char *buf)
+{
+	struct serial_private *priv = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", priv ? priv->line_base : -1);
+}
+
+static ssize_t lines_show(struct device *dev, struct device_attribute *attr,
+						  char *buf)
+{
+	struct serial_private *priv = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	if (!priv)
+		return -ENODEV;
+
+	for (i = 0; i < priv->nr; i++)
+		len += sprintf(buf + len, "%s%d", i ? " " : "", priv->line[i]);
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+
+static ssize_t irq_cpu_show(struct device *dev, struct device_attribute *attr,
+							char *buf)
+{
+	struct serial_private *priv = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", priv ? READ_ONCE(priv->irq_cpu) : -1);
+}
+
+static DEVICE_ATTR_RO(slot);
+static DEVICE_ATTR_RO(line_base);
+static DEVICE_ATTR_RO(lines);
+static DEVICE_ATTR_RO(irq_cpu);
+
+static struct attribute *addi_board_attrs[] = {
+	&dev_attr_slot.attr,
+	&dev_attr_line_base.attr,
+	&dev_attr_lines.attr,
+	&dev_attr_irq_cpu.attr,
+	NULL,
+};
+
+static const struct attribute_group addi_board_group = {
+	.attrs = addi_board_attrs,
+};
+
+struct serial_private *
+addi_pciserial_init_ports(struct pci_dev *dev, const struct pciserial_board *board)
+{
+	struct uart_8250_port uart;
+	struct serial_private *priv;
+	struct pci_serial_quirk *quirk;
+	int rc, nr_ports, i;
+
+	nr_ports = min_t(int, board->num_ports, ADDI_SERIAL_MAX_PORTS);
+
+	/*
+	 * Find an init and setup quirks.
+	 */
+	quirk = find_quirk(dev);
+
+	/*
+	 * Run the new-style initialization function.
+	 * The initialization function returns:
+	 *  <0  - error
+	 *   0  - use board->num_ports
+	 *  >0  - number of ports
+	 */
+	if (quirk->init)
+	{
+		rc = quirk->init(dev);
+		if (rc < 0)
+		{
+			priv = ERR_PTR(rc);
+			goto err_out;
+		}
+		if (rc)
+			nr_ports = min_t(int, rc, ADDI_SERIAL_MAX_PORTS);
+	}
+
+	priv = kzalloc(sizeof(struct serial_private) +
+					   sizeof(unsigned int) * nr_ports,
+				   GFP_KERNEL);
+	if (!priv)
+	{
+		priv = ERR_PTR(-ENOMEM);
+		goto err_deinit;
+	}
+
+	priv->dev = dev;
+	priv->quirk = quirk;
+	priv->line_base = addi_serial_line_base(dev);
+
+	memset(&uart, 0, sizeof(uart));
+	uart.port.flags = UPF_SKIP_TEST | UPF_BOOT_AUTOCONF | UPF_SHARE_IRQ;
+	uart.port.uartclk = board->base_baud * 16;
+	uart.port.irq = get_pci_irq(dev, board);
+	uart.port.dev = &dev->dev;
+
+	priv->irq = uart.port.irq;
+	addi_serial_irq_place(priv);
+
+	priv->debugfs = debugfs_create_dir(pci_name(dev), addi_serial_debugfs);
+	debugfs_create_file("board", 0444, priv->debugfs, priv,
+						&addi_board_stats_fops);
+	debugfs_create_file("capture", 0400, priv->debugfs, priv,
+						&addi_capture_fops);
+
+	for (i = 0; i < nr_ports; i++)
+	{
+		struct addi_port *ap;
+		char name[8];
+
+		if (quirk->setup(priv, board, &uart, i))
+			break;
+
+		ap = kzalloc(sizeof(*ap), GFP_KERNEL);
+		if (!ap)
+			break;
+		kobject_init(&ap->kobj, &addi_port_ktype);
+		ap->priv = priv;
+		ap->idx = i;
+
+		/*
+		 * The 8250 core honours port.line when that line is still
+		 * free, otherwise it hands out the first unused one.
+		 */
+		uart.port.line = priv->line_base >= 0 ? priv->line_base + i : 0;
+		uart.port.private_data = ap;
+		uart.port.handle_irq = addi_serial_handle_irq;
+		uart.port.startup = addi_serial_startup;
+		uart.port.shutdown = addi_serial_shutdown;
+		uart.port.set_termios = addi_serial_set_termios;
+
+		dev_dbg(&dev->dev, "Setup PCI port: port %lx, irq %d, type %d\n",
+				uart.port.iobase, uart.port.irq, uart.port.iotype);
+
+		priv->line[i] = serial8250_register_8250_port(&uart);
+		if (priv->line[i] < 0)
+		{
+			dev_err(&dev->dev,
+					"Couldn't register serial port %lx, irq %d, type %d, error %d\n",
+					uart.port.iobase, uart.port.irq,
+					uart.port.iotype, priv->line[i]);
+			kobject_put(&ap->kobj);
+			break;
+		}
+
+		if (priv->line_base >= 0 && priv->line[i] != priv->line_base + i)
+			dev_warn(&dev->dev, "port %d: line %d busy, using ttyS%d\n",
+					 i, priv->line_base + i, priv->line[i]);
+
+		ap->line = priv->line[i];
+		if (addi_serial_attach_port(ap, ap->line))
+		{
+			addi_serial_release_line(ap, priv->line[i]);
+			kobject_put(&ap->kobj);
+			break;
+		}
+		priv->port[i] = ap;
+		if (kobject_add(&ap->kobj, &dev->dev.kobj, "port%d", i))
+			dev_warn(&dev->dev, "port %d: no sysfs directory\n", i);
+
+		snprintf(name, sizeof(name), "port%d", i);
+		ap->debugfs = debugfs_create_file(name, 0444, priv->debugfs, ap,
+										  &addi_port_stats_fops);
+	}
+	priv->nr = i;
+	priv->board = board;
+	addi_serial_board_irq_init(priv, board);
+	return priv;
+
+err_deinit:
+	if (quirk->exit)
+		quirk->exit(dev);
+err_out:
+	return priv;
+}
+EXPORT_SYMBOL_GPL(addi_pciserial_init_ports);
+
+static void pciserial_detach_ports(struct serial_private *priv)
+{
+	struct pci_serial_quirk *quirk;
+	int i;
+
+	debugfs_remove_recursive(priv->debugfs);
+	priv->debugfs = NULL;
+	addi_serial_board_irq_exit(priv);
+	/* Keep the rebalancer away from ports about to go */
+	addi_serial_irq_forget(priv);
+
+	for (i = 0; i < priv->nr; i++)
+	{
+		addi_console_detach(priv->port[i]);
+		priv->port[i]->warm = false;
+		addi_serial_cool(priv->port[i]);
+		addi_serial_detach_port(priv->port[i]);
+		addi_serial_release_line(priv->port[i], priv->line[i]);
+		kobject_put(&priv->port[i]->kobj);
+		priv->port[i] = NULL;
+	}
+	addi_capture_free(priv);
+
+	/*
+	 * Find the exit quirks.
+	 */
+	quirk = find_quirk(priv->dev);
+	if (quirk->exit)
+		quirk->exit(priv->dev);
+}
+
+void addi_pciserial_remove_ports(struct serial_private *priv)
+{
+	pciserial_detach_ports(priv);
+	kfree(priv);
+}
+EXPORT_SYMBOL_GPL(addi_pciserial_remove_ports);
+
+void addi_pciserial_suspend_ports(struct serial_private *priv)
+{
+	int i;
+
+	for (i = 0; i < priv->nr; i++)
+	{
+		struct addi_port *ap = priv->port[i];
+		bool warm = ap->warm;
+
+		/* The UART loses its settings, so shut down cold */
+		ap->warm = false;
+		addi_serial_cool(ap);
+		serial8250_suspend_port(priv->line[i]);
+		ap->warm = warm;
+	}
+
+	/*
+	 * Ensure that every init quirk is properly torn down
+	 */
+	if (priv->quirk->exit)
+		priv->quirk->exit(priv->dev);
+}
+EXPORT_SYMBOL_GPL(addi_pciserial_suspend_ports);
+
+void addi_pciserial_resume_ports(struct serial_private *priv)
+{
+	int i;
+
+	/*
+	 * Ensure that the board is correctly configured.
+	 */
+	if (priv->quirk->init)
+		priv->quirk->init(priv->dev);
+
+	for (i = 0; i < priv->nr; i++)
+		if (priv->line[i] >= 0)
+			serial8250_resume_port(priv->line[i]);
+}
+EXPORT_SYMBOL_GPL(addi_pciserial_resume_ports);
+
+/*
+ * Probe one serial board.  Unfortunately, there is no rhyme nor reason
+ * to the arrangement of serial ports on a PCI card.
+ */
+static int
+pciserial_init_one(struct pci_dev *dev, const struct pci_device_id *ent)
+{
+	struct pci_serial_quirk *quirk;
+	struct serial_private *priv;
+	const struct pciserial_board *board;
+	struct pciserial_board tmp;
+	int rc;
+
+	quirk = find_quirk(dev);
+	if (quirk->probe)
+	{
+		rc = quirk->probe(dev);
+		if (rc)
+			return rc;
+	}
+
+	if (ent->driver_data >= ARRAY_SIZE(pci_boards))
 	{
 		dev_err(&dev->dev, "invalid driver_data: %ld\n",
 				ent->driver_data);
@@ -801,11 +6004,22 @@ pciserial_init_one(struct pci_dev *dev, const struct pci_device_id *ent)
 						dev);
 	}
 
+	if (msi && pci_alloc_irq_vectors(dev, 1, 1, PCI_IRQ_MSI) < 0)
+		dev_info(&dev->dev, "MSI not available, using INTx\n");
+
 	priv = addi_pciserial_init_ports(dev, board);
 	if (IS_ERR(priv))
+	{
+		pci_free_irq_vectors(dev);
 		return PTR_ERR(priv);
+	}
 
 	pci_set_drvdata(dev, priv);
+
+	rc = sysfs_create_group(&dev->dev.kobj, &addi_board_group);
+	if (rc)
+		dev_warn(&dev->dev, "Couldn't create sysfs attributes\n");
+
 	return 0;
 }
 
@@ -813,7 +6027,9 @@ static void pciserial_remove_one(struct pci_dev *dev)
 {
 	struct serial_private *priv = pci_get_drvdata(dev);
 
+	sysfs_remove_group(&dev->dev.kobj, &addi_board_group);
 	addi_pciserial_remove_ports(priv);
+	pci_free_irq_vectors(dev);
 }
 
 #ifdef CONFIG_PM_SLEEP
@@ -1057,7 +6273,60 @@ static struct pci_driver serial_pci_driver = {
 	.err_handler = &serial8250_err_handler,
 };
 
-module_pci_driver(serial_pci_driver);
+static int __init addi_serial_init(void)
+{
+	int rc;
+
+	addi_serial_debugfs = debugfs_create_dir("addi_serial", NULL);
+
+	if (!irq_cpus || cpulist_parse(irq_cpus, &addi_irq_mask))
+		cpumask_copy(&addi_irq_mask, cpu_online_mask);
+	cpumask_and(&addi_irq_mask, &addi_irq_mask, cpu_online_mask);
+	if (cpumask_empty(&addi_irq_mask))
+		cpumask_copy(&addi_irq_mask, cpu_online_mask);
+
+	if (ldisc > 0)
+	{
+		rc = tty_register_ldisc(ldisc, &addi_ldisc_ops);
+		if (rc)
+			pr_warn("addi_serial: line discipline %d not registered: %d\n",
+					ldisc, rc);
+		addi_ldisc_registered = !rc;
+	}
+
+	rc = pci_register_driver(&serial_pci_driver);
+	if (rc)
+	{
+		if (addi_ldisc_registered)
+			tty_unregister_ldisc(ldisc);
+		debugfs_remove_recursive(addi_serial_debugfs);
+		return rc;
+	}
+
+	if (irq_balance_ms)
+		schedule_delayed_work(&addi_serial_balance_work,
+							  msecs_to_jiffies(irq_balance_ms));
+
+	/* Picks up console=ttyAD<line> once the ports are there */
+	init_irq_work(&addi_con_work, addi_console_kick);
+	hrtimer_init(&addi_con_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	addi_con_timer.function = addi_console_poll;
+	register_console(&addi_console);
+	return 0;
+}
+
+static void __exit addi_serial_exit(void)
+{
+	cancel_delayed_work_sync(&addi_serial_balance_work);
+	unregister_console(&addi_console);
+	pci_unregister_driver(&serial_pci_driver);
+	if (addi_ldisc_registered)
+		tty_unregister_ldisc(ldisc);
+	debugfs_remove_recursive(addi_serial_debugfs);
+}
+
+module_init(addi_serial_init);
+module_exit(addi_serial_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Generic 8250/16x50 PCI ADDI-DATA serial probe module");
@@ -0,0 +1,291 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ *  Userspace interface of the ADDI-DATA serial driver.
+ *
+ *  All requests are issued on the ttyS file descriptor of the port.
+ */
+#ifndef _ADDI_SERIAL_H
+#define _ADDI_SERIAL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ADDI_SERIAL_IOC_MAGIC	0xAD
+
+/*
+ * Buffer handed to the driver.  data is a user pointer cast to __u64;
+ * flags must be 0.
+ */
+struct addi_serial_write {
+	__u64	data;
+	__u32	len;
+	__u32	flags;
+};
+
+/*
+ * Queue a frame on the high-priority TX lane.  The frame is sent ahead
+ * of everything written through write(); it is queued whole or the
+ * call fails with EAGAIN.
+ */
+#define ADDI_SERIAL_IOC_URGENT_WRITE \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x01, struct addi_serial_write)
+
+/*
+ * Frame to be launched at a CLOCK_MONOTONIC time.  The driver starts
+ * loading the FIFO from an hrtimer at when_ns and later reports the
+ * actual time the first byte went into the transmitter.
+ */
+struct addi_serial_timed_write {
+	__u64	data;
+	__u64	when_ns;
+	__u32	len;
+	__u32	id;
+};
+
+struct addi_serial_timed_report {
+	__u64	target_ns;
+	__u64	launch_ns;
+	__u32	id;
+	__u32	len;
+};
+
+#define ADDI_SERIAL_TIMED_MAX_LEN	4096
+
+#define ADDI_SERIAL_IOC_TIMED_WRITE \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x02, struct addi_serial_timed_write)
+/* Oldest unread launch report, EAGAIN if there is none */
+#define ADDI_SERIAL_IOC_TIMED_REPORT \
+	_IOR(ADDI_SERIAL_IOC_MAGIC, 0x03, struct addi_serial_timed_report)
+
+/*
+ * Keep CPUs out of deep C-states while the port is open.  latency_us is
+ * the longest acceptable wakeup latency, negative for no request.  With
+ * ADDI_SERIAL_LATENCY_IRQ_CPU only the CPU handling the board interrupt
+ * is held back, otherwise all CPUs are.  Needs CAP_SYS_ADMIN.
+ */
+struct addi_serial_latency {
+	__s32	latency_us;
+	__u32	flags;
+};
+
+#define ADDI_SERIAL_LATENCY_IRQ_CPU	(1 << 0)
+
+#define ADDI_SERIAL_IOC_SET_LATENCY \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x04, struct addi_serial_latency)
+
+/*
+ * Forward everything this port receives into the TX ring of the port
+ * on tty line @line, from the interrupt handler.  line < 0 removes the
+ * bridge.  BIDIR sets up the reverse direction as well; with MONITOR
+ * the received data is still delivered to this port's tty too, so it
+ * can be sniffed.
+ */
+struct addi_serial_bridge {
+	__s32	line;
+	__u32	flags;
+};
+
+#define ADDI_SERIAL_BRIDGE_BIDIR	(1 << 0)
+#define ADDI_SERIAL_BRIDGE_MONITOR	(1 << 1)
+
+#define ADDI_SERIAL_IOC_BRIDGE \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x05, struct addi_serial_bridge)
+
+/*
+ * Queue the same data on every open port of this port's group (see
+ * portN/group in sysfs).  The data is copied once and shared.  With
+ * ADDI_SERIAL_GROUP_SYNC all members start sending it together.
+ * Returns the number of ports it was queued on.
+ */
+struct addi_serial_group_write {
+	__u64	data;
+	__u32	len;
+	__u32	flags;
+};
+
+#define ADDI_SERIAL_GROUP_SYNC		(1 << 0)
+#define ADDI_SERIAL_GROUP_MAX_LEN	65536
+
+#define ADDI_SERIAL_IOC_GROUP_WRITE \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x06, struct addi_serial_group_write)
+
+/*
+ * Synchronised start of pre-loaded frames on several ports of one
+ * board.  SYNC_ARM with a non-zero argument (the value itself, not a
+ * pointer) holds the port's transmitter, so write() and the other
+ * ioctls only queue data; zero lets it go again.  SYNC_START on any
+ * port of the board then loads the armed ports in @ports (a mask of
+ * port indices on the board) and releases them in one register
+ * sequence.  On return @skew_ns is the time between releasing the
+ * first and the last port and @method tells how they were held.
+ */
+struct addi_serial_sync_start {
+	__u32	ports;
+	__u32	flags;
+	__u32	skew_ns;
+	__u32	method;
+};
+
+/* Held with the 16C950 transmitter disabled, FIFOs loaded in advance */
+#define ADDI_SERIAL_SYNC_TXDIS		0
+/* No way to hold a loaded FIFO: FIFOs loaded back to back on release */
+#define ADDI_SERIAL_SYNC_FIFO_LOAD	1
+
+#define ADDI_SERIAL_IOC_SYNC_ARM \
+	_IO(ADDI_SERIAL_IOC_MAGIC, 0x07)
+#define ADDI_SERIAL_IOC_SYNC_START \
+	_IOWR(ADDI_SERIAL_IOC_MAGIC, 0x08, struct addi_serial_sync_start)
+
+/*
+ * Auto-responder.  Every good byte received is appended to the current
+ * frame, which starts over after a gap of 3.5 characters or an RX
+ * timeout.  When the frame equals @match in the bits set in @mask, over
+ * @match_len bytes, @reply is sent at once from the interrupt handler.
+ * An entry must cover the whole request, CRC included: it is matched
+ * when its last byte arrives, and refused if more bytes are already
+ * waiting in the RX FIFO.
+ * The received data still goes to the tty as usual.  Before sending,
+ * each @copy moves @len bytes at @from in the frame to @to in the reply
+ * (addresses, sequence numbers); MODBUS_CRC appends the Modbus CRC-16.
+ * The first matching entry wins.
+ */
+#define ADDI_SERIAL_RESP_MATCH_LEN	32
+#define ADDI_SERIAL_RESP_REPLY_LEN	64
+#define ADDI_SERIAL_RESP_COPIES		4
+#define ADDI_SERIAL_RESP_ENTRIES	32
+
+struct addi_serial_response {
+	__u8	match[ADDI_SERIAL_RESP_MATCH_LEN];
+	__u8	mask[ADDI_SERIAL_RESP_MATCH_LEN];
+	__u8	reply[ADDI_SERIAL_RESP_REPLY_LEN];
+	__u8	match_len;
+	__u8	reply_len;
+	__u8	ncopy;
+	__u8	flags;
+	struct {
+		__u8	from;
+		__u8	to;
+		__u8	len;
+		__u8	pad;
+	} copy[ADDI_SERIAL_RESP_COPIES];
+};
+
+#define ADDI_SERIAL_RESP_MODBUS_CRC	(1 << 0)
+
+/* Load @count entries from @entries; count = 0 turns the responder off */
+struct addi_serial_responder {
+	__u64	entries;
+	__u32	count;
+	__u32	flags;
+};
+
+#define ADDI_SERIAL_IOC_RESPONDER \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x09, struct addi_serial_responder)
+
+/*
+ * Framed receive for the addi_raw line discipline, set on the tty while
+ * addi_raw is its line discipline.  Received data is cut into frames,
+ * either at @delim (@delim_len bytes, not passed on) or by a length
+ * field of @len_width bytes at @len_offset whose value plus @len_adjust
+ * is the length of the whole frame, CRC included.  A frame whose CRC
+ * (little-endian, after the data) is wrong is dropped; the CRC of a good
+ * one is stripped.  Each read() then returns one frame, cut short if the
+ * buffer is too small, and poll() reports POLLIN only for whole frames.
+ * @max_len = 0 means 4096.
+ */
+struct addi_serial_framing {
+	__u32	mode;
+	__u32	crc;
+	__u32	max_len;
+	__u8	delim[2];
+	__u8	delim_len;
+	__u8	len_offset;
+	__u8	len_width;
+	__u8	len_flags;
+	__s16	len_adjust;
+};
+
+#define ADDI_SERIAL_FRAME_OFF		0
+#define ADDI_SERIAL_FRAME_DELIM		1
+#define ADDI_SERIAL_FRAME_LENGTH	2
+
+/* CRC-16 as Modbus (crc16(), init 0xffff), CRC-32 as Ethernet */
+#define ADDI_SERIAL_FRAME_CRC_NONE	0
+#define ADDI_SERIAL_FRAME_CRC16		1
+#define ADDI_SERIAL_FRAME_CRC32		2
+
+#define ADDI_SERIAL_FRAME_LEN_BE	(1 << 0)
+
+#define ADDI_SERIAL_IOC_FRAMING \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x0a, struct addi_serial_framing)
+
+/*
+ * Traffic capture.  debugfs addi_serial/<pci device>/capture reads as a
+ * pcap file with nanosecond timestamps and link type LINKTYPE_USER0
+ * (147).  Each packet is one RX or TX burst of a port: this header,
+ * then the data.  flags is ADDI_SERIAL_CAP_TX for sent data; for
+ * received data it has the UART_LSR_OE/PE/FE/BI bits seen in the burst.
+ */
+struct addi_serial_cap_hdr {
+	__u8	port;
+	__u8	flags;
+	__u16	reserved;
+};
+
+#define ADDI_SERIAL_CAP_TX		0x01
+
+/*
+ * Run a sequence of modem control changes from an hrtimer.  Each step
+ * sets the TIOCM_DTR/RTS/OUT1/OUT2/LOOP bits of @mctrl, leaving the
+ * others alone, and the next step follows @delay_ns later.  The call
+ * returns once the last step is done, with the number of steps run;
+ * @actual (count __u64s) gets each step's offset in ns from the
+ * scheduled start, for checking the timing.  The port's other users
+ * wait for the call, so a sequence may span at most
+ * ADDI_SERIAL_MCR_MAX_NS.
+ */
+struct addi_serial_mcr_step {
+	__u32	mctrl;
+	__u32	delay_ns;
+};
+
+struct addi_serial_mcr_seq {
+	__u64	steps;
+	__u64	actual;
+	__u32	count;
+	__u32	flags;
+};
+
+#define ADDI_SERIAL_MCR_STEPS		64
+#define ADDI_SERIAL_MCR_MAX_NS		1000000000
+
+#define ADDI_SERIAL_IOC_MCR_SEQUENCE \
+	_IOW(ADDI_SERIAL_IOC_MAGIC, 0x0b, struct addi_serial_mcr_seq)
+
+/*
+ * Detect the baud rate of an open port from the data it receives.
+ * Standard rates are tried from fast to slow; a rate is taken once
+ * @good bytes in a row arrive without framing or parity errors (and, if
+ * @sync >= 0, equal to @sync), twice, with the receiver resynced in
+ * between.  Bytes seen meanwhile are dropped.  On success @baud is set
+ * and the UART already runs at it; the tty's termios is switched to it
+ * shortly after the call returns, so a tcgetattr() right away may
+ * still show the old rate.  On timeout the old rate is put back and the
+ * call fails with ETIMEDOUT; if the UART clock gives none of the
+ * standard rates it fails with EINVAL.
+ * The port's other users wait for the call, so @timeout_ms is at most
+ * ADDI_SERIAL_AUTOBAUD_MAX_MS; call again to keep listening.
+ */
+struct addi_serial_autobaud {
+	__u32	timeout_ms;
+	__s32	sync;
+	__u32	good;
+	__u32	baud;
+};
+
+#define ADDI_SERIAL_AUTOBAUD_MAX_MS	1000
+
+#define ADDI_SERIAL_IOC_AUTOBAUD \
+	_IOWR(ADDI_SERIAL_IOC_MAGIC, 0x0c, struct addi_serial_autobaud)
+
+#endif /* _ADDI_SERIAL_H */